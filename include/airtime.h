@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+
+// LoRa modem settings, as passed to SX1262::begin()
+struct LoRaParams
+{
+    float freq;              // carrier frequency in MHz
+    float bw;                // bandwidth in kHz
+    uint8_t sf;              // spreading factor, 5 to 12
+    uint8_t cr;              // coding rate denominator, 5 to 8 (4/5 to 4/8)
+    uint8_t syncWord;        // 0x34 (public network/LoRaWAN), 0x24 (private)
+    int8_t power;            // output power in dBm
+    uint16_t preambleLength; // preamble length in symbols
+    bool implicitHeader;
+    bool crc;
+};
+
+// preamble used by the fast profile, see fastProfile()
+#define FAST_PREAMBLE_LENGTH 8
+
+// SX1262 supply currents from the datasheet, DC-DC regulator
+#define SX126X_TX_CURRENT_MA 118.0f // +22 dBm
+#define SX126X_RX_CURRENT_MA 4.6f
+#define SUPPLY_VOLTAGE 3.3f
+
+constexpr uint32_t bandwidthHz(const LoRaParams &p)
+{
+    return (uint32_t)(p.bw * 1000.0f + 0.5f);
+}
+
+// RadioLib turns on low data rate optimization when a symbol is 16 ms or longer
+constexpr bool lowDataRateOptimize(const LoRaParams &p)
+{
+    return ((uint64_t)1000 << p.sf) >= (uint64_t)16 * bandwidthHz(p);
+}
+
+constexpr uint32_t symbolTimeUs(const LoRaParams &p)
+{
+    return ((uint64_t)1000000 << p.sf) / bandwidthHz(p);
+}
+
+// Time on air of a packet with len payload bytes, in microseconds.
+// Follows the SX126x datasheet, section 6.1.4.
+constexpr uint32_t timeOnAirUs(const LoRaParams &p, uint8_t len)
+{
+    int32_t bits = 8 * len + (p.crc ? 16 : 0) - 4 * p.sf + (p.implicitHeader ? 0 : 20);
+    int32_t bitsPerSymbol = 4 * p.sf;
+    // counted in quarter symbols to keep the 4.25 and 6.25 exact
+    uint32_t quarterSymbols = 4 * p.preambleLength;
+    if (p.sf < 7)
+    {
+        quarterSymbols += 25;
+    }
+    else
+    {
+        bits += 8;
+        bitsPerSymbol -= lowDataRateOptimize(p) ? 8 : 0;
+        quarterSymbols += 17;
+    }
+    if (bits < 0)
+    {
+        bits = 0;
+    }
+    uint32_t payloadSymbols = 8 + (uint32_t)((bits + bitsPerSymbol - 1) / bitsPerSymbol) * p.cr;
+    quarterSymbols += 4 * payloadSymbols;
+    return ((uint64_t)quarterSymbols * 1000000 << p.sf) / (4 * (uint64_t)bandwidthHz(p));
+}
+
+// Fast profile: implicit header and a short preamble, for links that only
+// ever carry packets of a length both ends know in advance
+constexpr LoRaParams fastProfile(LoRaParams p)
+{
+    p.implicitHeader = true;
+    p.preambleLength = FAST_PREAMBLE_LENGTH;
+    return p;
+}
+
+// SX126x RX duty cycle (sniff) timing: sleep and listen in turns so that
+// every preamble of p.preambleLength symbols overlaps at least minSymbols
+// of listening. Both are 0 when the preamble is too short to sleep at all,
+// or the sleep wouldn't cover the TCXO start up and the ~1 ms it takes the
+// chip to go to sleep and wake up again.
+struct SniffTiming
+{
+    uint32_t rxUs;
+    uint32_t sleepUs;
+};
+
+constexpr SniffTiming sniffTiming(const LoRaParams &p, uint16_t minSymbols, uint32_t tcxoDelayUs)
+{
+    uint32_t symbol = symbolTimeUs(p);
+    if (p.preambleLength <= 2 * minSymbols)
+    {
+        return {0, 0};
+    }
+    // same split as RadioLib's startReceiveDutyCycleAuto(), including its
+    // fallback to continuous RX: startReceiveDutyCycle() takes the
+    // transition time off the sleep and fails if nothing is left
+    uint32_t sleepUs = symbol * (p.preambleLength - 2 * minSymbols);
+    if (sleepUs < tcxoDelayUs + 1016)
+    {
+        return {0, 0};
+    }
+    uint32_t rxUs = (symbol * (p.preambleLength + 1) - (sleepUs - 1000)) / 2;
+    if (rxUs < symbol * (minSymbols + 1))
+    {
+        rxUs = symbol * (minSymbols + 1);
+    }
+    return {rxUs, sleepUs};
+}
+
+// Rough SX1262 TX current at lower output powers, with the PA set up for +22 dBm
+inline float txCurrentMa(int8_t power)
+{
+    return power >= 22 ? SX126X_TX_CURRENT_MA : power >= 20 ? 102.0f : power >= 17 ? 90.0f : power >= 14 ? 75.0f : power >= 10 ? 60.0f : 45.0f;
+}
+
+// Energy drawn while the radio spends timeUs at the given current, in millijoules
+constexpr float energyMj(uint32_t timeUs, float currentMa)
+{
+    return timeUs / 1e6f * currentMa * SUPPLY_VOLTAGE;
+}
+
+// SF7/BW125/CR4/5, 8 symbol preamble, 10 bytes is 41.216 ms in the Semtech calculator
+static_assert(timeOnAirUs(LoRaParams{868.0f, 125.0f, 7, 5, 0x24, 14, 8, false, true}, 10) == 41216, "LoRa time on air");
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdint.h>
+
+// EU868 duty cycle accounting (ETSI EN 300 220, as used by LoRaWAN).
+// Each sub-band allows a share of every hour on air. The ledger keeps the
+// airtime per sub-band in 10 minute slots; the current slot and the six
+// before it always cover at least the last hour, so staying under the
+// budget over those seven slots stays under it over any hour.
+
+struct SubBand
+{
+    float low;  // MHz
+    float high; // MHz
+    uint16_t permille; // allowed share of the time on air
+};
+
+const SubBand subBands[] = {
+    {863.0, 865.0, 1},    // 0.1%
+    {865.0, 868.0, 10},   // 1%
+    {868.0, 868.6, 10},   // 1%
+    {868.7, 869.2, 1},    // 0.1%
+    {869.4, 869.65, 100}, // 10%
+    {869.7, 870.0, 10},   // 1%
+};
+
+#define SUB_BAND_COUNT (sizeof(subBands) / sizeof(subBands[0]))
+
+#define DUTY_CYCLE_WINDOW_S 3600
+#define DUTY_CYCLE_SLOT_S 600
+#define DUTY_CYCLE_SLOTS 7
+// airtime is counted in these units, rounded up, to fit 10% of an hour in a uint16
+#define DUTY_CYCLE_UNIT_MS 10
+
+struct DutyCycleLedger
+{
+    uint32_t slot; // node clock / DUTY_CYCLE_SLOT_S of the current slot
+    uint16_t used[SUB_BAND_COUNT][DUTY_CYCLE_SLOTS];
+};
+
+// Sub-band of a carrier frequency in MHz, -1 outside the ones we may use
+inline int subBandIndex(float freq)
+{
+    for (unsigned i = 0; i < SUB_BAND_COUNT; i++)
+    {
+        if (freq >= subBands[i].low && freq < subBands[i].high)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+inline uint32_t dutyCycleBudgetMs(int band)
+{
+    return band < 0 ? 0 : (uint32_t)DUTY_CYCLE_WINDOW_S * subBands[band].permille;
+}
+
+// Move the ledger to the slot of the given node clock, clearing the slots in between
+inline void dutyCycleAdvance(DutyCycleLedger &ledger, uint32_t clock)
+{
+    uint32_t slot = clock / DUTY_CYCLE_SLOT_S;
+    // a clock that went backwards (RTC memory lost) clears everything too
+    uint32_t passed = slot >= ledger.slot ? slot - ledger.slot : DUTY_CYCLE_SLOTS;
+    for (uint32_t i = 1; i <= passed && i <= DUTY_CYCLE_SLOTS; i++)
+    {
+        for (unsigned band = 0; band < SUB_BAND_COUNT; band++)
+        {
+            ledger.used[band][(ledger.slot + i) % DUTY_CYCLE_SLOTS] = 0;
+        }
+    }
+    ledger.slot = slot;
+}
+
+inline uint32_t dutyCycleUsedMs(const DutyCycleLedger &ledger, int band)
+{
+    if (band < 0)
+    {
+        return 0;
+    }
+    uint32_t used = 0;
+    for (unsigned i = 0; i < DUTY_CYCLE_SLOTS; i++)
+    {
+        used += ledger.used[band][i];
+    }
+    return used * DUTY_CYCLE_UNIT_MS;
+}
+
+inline uint32_t dutyCycleUnits(uint32_t airtimeUs)
+{
+    return (airtimeUs + DUTY_CYCLE_UNIT_MS * 1000 - 1) / (DUTY_CYCLE_UNIT_MS * 1000);
+}
+
+inline bool dutyCycleAllows(const DutyCycleLedger &ledger, int band, uint32_t airtimeUs)
+{
+    return dutyCycleUsedMs(ledger, band) + dutyCycleUnits(airtimeUs) * DUTY_CYCLE_UNIT_MS <= dutyCycleBudgetMs(band);
+}
+
+inline void dutyCycleCharge(DutyCycleLedger &ledger, int band, uint32_t airtimeUs)
+{
+    if (band < 0)
+    {
+        return;
+    }
+    uint16_t &used = ledger.used[band][ledger.slot % DUTY_CYCLE_SLOTS];
+    uint32_t total = used + dutyCycleUnits(airtimeUs);
+    used = total > 0xffff ? 0xffff : total;
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "frame.h"
+
+// Fragmented transfers, for payloads that don't fit one frame on the
+// data rate in use. The payload is itself a v2 frame (a MSG_SERIES with
+// the backlog, or a relay's MSG_RELAY), cut into chunks of equal size
+// that go out as MSG_FRAGMENT frames:
+//   bytes 0-4   header, the message id identifies the transfer
+//   byte 5      fragment index (low 5 bits) | FRAGMENT_PARITY | FRAGMENT_ACK_REQUEST
+//   byte 6      fragments in the transfer
+//   byte 7      chunk size, every fragment but the last carries this many bytes
+//   byte 8      parity group size, 0 when the transfer has no parity fragments
+//   then the chunk
+//
+// The node sends all fragments the gateway is missing back to back and
+// sets FRAGMENT_ACK_REQUEST on the last one of the round. The ACK to it
+// carries a bitmap of the fragments received so far (ACK_FLAG_FRAGMENTS),
+// so the next round only repeats the ones that got lost.
+//
+// On lossy links the first round also carries parity fragments, marked
+// with FRAGMENT_PARITY. Parity fragment g is the XOR of data fragments
+// g * group to g * group + group - 1, each padded with zeros to the chunk
+// size, preceded by the transfer length (uint16). With it the receiver
+// rebuilds one lost fragment per group without another round.
+
+#define FRAGMENT_HEADER_SIZE (FRAME_HEADER_SIZE + 4)
+// the ACK bitmap has one bit per fragment
+#define FRAGMENT_MAX 32
+#define FRAGMENT_INDEX_MASK 0x1f
+#define FRAGMENT_PARITY 0x40
+#define FRAGMENT_ACK_REQUEST 0x80
+#define FRAGMENT_CHUNK_MAX (FRAME_MAX_SIZE - FRAGMENT_HEADER_SIZE - 2)
+#define TRANSFER_MAX_SIZE (FRAGMENT_MAX * FRAGMENT_CHUNK_MAX)
+
+// Bitmap with the first count bits set
+inline uint32_t fragmentMask(uint8_t count)
+{
+    return count >= 32 ? 0xffffffff : (1UL << count) - 1;
+}
+
+inline uint8_t fragmentCount(size_t length, uint8_t chunk)
+{
+    return (length + chunk - 1) / chunk;
+}
+
+inline uint8_t parityCount(uint8_t fragments, uint8_t group)
+{
+    return group == 0 ? 0 : (fragments + group - 1) / group;
+}
+
+// Bytes in data fragment index, only the last one can be short
+inline size_t fragmentSize(size_t length, uint8_t chunk, uint8_t index)
+{
+    size_t offset = (size_t)index * chunk;
+    return length - offset < chunk ? length - offset : chunk;
+}
+
+inline size_t encodeFragmentHeader(uint8_t *buf, uint16_t address, uint16_t transferId, size_t length, uint8_t chunk, uint8_t group,
+                                   uint8_t index, bool parity, bool ackRequest)
+{
+    FrameHeader header = {MSG_FRAGMENT, address, transferId};
+    size_t len = encodeHeader(buf, header);
+    buf[len] = (index & FRAGMENT_INDEX_MASK) | (parity ? FRAGMENT_PARITY : 0) | (ackRequest ? FRAGMENT_ACK_REQUEST : 0);
+    buf[len + 1] = fragmentCount(length, chunk);
+    buf[len + 2] = chunk;
+    buf[len + 3] = group;
+    return FRAGMENT_HEADER_SIZE;
+}
+
+inline size_t encodeFragment(uint8_t *buf, uint16_t address, uint16_t transferId, const uint8_t *payload, size_t length, uint8_t chunk,
+                             uint8_t group, uint8_t index, bool ackRequest)
+{
+    size_t len = encodeFragmentHeader(buf, address, transferId, length, chunk, group, index, false, ackRequest);
+    size_t size = fragmentSize(length, chunk, index);
+    memcpy(buf + len, payload + (size_t)index * chunk, size);
+    return len + size;
+}
+
+// Parity fragment for the given group of data fragments
+inline size_t encodeParity(uint8_t *buf, uint16_t address, uint16_t transferId, const uint8_t *payload, size_t length, uint8_t chunk,
+                           uint8_t group, uint8_t index, bool ackRequest)
+{
+    size_t len = encodeFragmentHeader(buf, address, transferId, length, chunk, group, index, true, ackRequest);
+    putU16(buf + len, length);
+    len += 2;
+    uint8_t *parity = buf + len;
+    memset(parity, 0, chunk);
+    uint8_t first = index * group;
+    uint8_t end = first + group < fragmentCount(length, chunk) ? first + group : fragmentCount(length, chunk);
+    for (uint8_t i = first; i < end; i++)
+    {
+        const uint8_t *data = payload + (size_t)i * chunk;
+        size_t size = fragmentSize(length, chunk, i);
+        for (size_t j = 0; j < size; j++)
+        {
+            parity[j] ^= data[j];
+        }
+    }
+    return len + chunk;
+}
+
+// Receiver side state of one transfer
+struct Reassembly
+{
+    uint16_t address;
+    uint16_t transferId;
+    uint8_t count; // fragments in the transfer, 0 while idle
+    uint8_t chunk;
+    uint8_t group;
+    uint32_t received;
+    uint32_t parityReceived;
+    size_t length; // 0 until the last fragment or a parity fragment came in
+    uint8_t data[TRANSFER_MAX_SIZE];
+    uint8_t parity[FRAGMENT_MAX][FRAGMENT_CHUNK_MAX];
+};
+
+// Rebuild the data fragments that are the only one missing from a group
+// whose parity fragment arrived
+inline void reassemblyRecover(Reassembly &r)
+{
+    for (uint8_t g = 0; g < parityCount(r.count, r.group); g++)
+    {
+        uint8_t first = g * r.group;
+        uint8_t end = first + r.group < r.count ? first + r.group : r.count;
+        uint32_t missing = (fragmentMask(end) & ~fragmentMask(first)) & ~r.received;
+        if (!(r.parityReceived & (1UL << g)) || missing == 0 || (missing & (missing - 1)) != 0)
+        {
+            continue;
+        }
+        uint8_t lost = first;
+        while (!(missing & (1UL << lost)))
+        {
+            lost++;
+        }
+        uint8_t *out = r.data + (size_t)lost * r.chunk;
+        size_t size = fragmentSize(r.length, r.chunk, lost);
+        memcpy(out, r.parity[g], size);
+        for (uint8_t i = first; i < end; i++)
+        {
+            if (i == lost)
+            {
+                continue;
+            }
+            const uint8_t *data = r.data + (size_t)i * r.chunk;
+            size_t other = fragmentSize(r.length, r.chunk, i);
+            for (size_t j = 0; j < size && j < other; j++)
+            {
+                out[j] ^= data[j];
+            }
+        }
+        r.received |= 1UL << lost;
+    }
+}
+
+// Add a MSG_FRAGMENT frame. A fragment of another transfer drops the one in
+// progress. Returns false if the frame is not a valid fragment.
+inline bool reassemblyAdd(Reassembly &r, const uint8_t *buf, size_t len)
+{
+    FrameHeader header;
+    if (!decodeHeader(buf, len, header) || header.type != MSG_FRAGMENT || len < FRAGMENT_HEADER_SIZE)
+    {
+        return false;
+    }
+    uint8_t index = buf[FRAME_HEADER_SIZE] & FRAGMENT_INDEX_MASK;
+    bool parity = buf[FRAME_HEADER_SIZE] & FRAGMENT_PARITY;
+    uint8_t count = buf[FRAME_HEADER_SIZE + 1];
+    uint8_t chunk = buf[FRAME_HEADER_SIZE + 2];
+    uint8_t group = buf[FRAME_HEADER_SIZE + 3];
+    size_t size = len - FRAGMENT_HEADER_SIZE;
+    bool last = !parity && index + 1 == count;
+    if (count == 0 || count > FRAGMENT_MAX || chunk == 0 || chunk > FRAGMENT_CHUNK_MAX ||
+        (parity ? index >= parityCount(count, group) || size != chunk + 2u : index >= count || (last ? size == 0 || size > chunk : size != chunk)))
+    {
+        return false;
+    }
+
+    if (r.count == 0 || r.address != header.address || r.transferId != header.messageId || r.count != count || r.chunk != chunk ||
+        r.group != group)
+    {
+        r.address = header.address;
+        r.transferId = header.messageId;
+        r.count = count;
+        r.chunk = chunk;
+        r.group = group;
+        r.received = 0;
+        r.parityReceived = 0;
+        r.length = 0;
+    }
+    if (parity)
+    {
+        r.length = getU16(buf + FRAGMENT_HEADER_SIZE);
+        if (fragmentCount(r.length, chunk) != count)
+        {
+            r.count = 0;
+            return false;
+        }
+        memcpy(r.parity[index], buf + FRAGMENT_HEADER_SIZE + 2, chunk);
+        r.parityReceived |= 1UL << index;
+    }
+    else
+    {
+        memcpy(r.data + (size_t)index * chunk, buf + FRAGMENT_HEADER_SIZE, size);
+        r.received |= 1UL << index;
+        if (last)
+        {
+            r.length = (size_t)index * chunk + size;
+        }
+    }
+    if (r.length != 0)
+    {
+        reassemblyRecover(r);
+    }
+    return true;
+}
+
+inline bool reassemblyComplete(const Reassembly &r)
+{
+    return r.count != 0 && r.received == fragmentMask(r.count);
+}
+
+// True when the fragment in buf asks for an ACK, to be answered with r.received
+// (which includes the fragments rebuilt from parity)
+inline bool fragmentAckRequested(const uint8_t *buf)
+{
+    return buf[FRAME_HEADER_SIZE] & FRAGMENT_ACK_REQUEST;
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "airtime.h"
+
+// v2 wire format, shared by the sensor nodes and the receiver.
+//
+// Every uplink starts with the same 5 byte header:
+//   byte 0      version (high nibble) | message type (low nibble)
+//   bytes 1-2   node address
+//   bytes 3-4   message id
+//
+// followed by a body that depends on the message type:
+//   MSG_DATA    epoch delta (uint16, seconds since the last ACKed epoch)
+//               temperature (int16, centi-degrees Celsius)
+//   MSG_BATCH   sample count (uint8)
+//               epoch delta (uint16, as in MSG_DATA)
+//               per sample: age (uint16, seconds before the epoch delta)
+//                           temperature (int16, centi-degrees Celsius)
+//   MSG_SERIES  the same readings as MSG_BATCH, compressed, see series.h
+//   MSG_FRAGMENT  part of a payload too large for one frame, see fragment.h
+//   MSG_RELAY   uplinks a relay node heard and already ACKed, each as
+//                 age (uint16, seconds the relay held it)
+//                 length (uint8)
+//                 the frame itself
+//               The epoch deltas inside refer to epochs the relay handed
+//               out, so time them by the age instead. Nodes heard by both
+//               arrive twice, drop repeats of the same address/message id.
+//   MSG_UPDATE_REQUEST  asks for a firmware update block, see update.h
+//   MSG_STATS   link quality histograms wrapped around another uplink, see stats.h
+//
+// The ACK is kept as short as possible, it only has to tell the node apart
+// from the few others that might be waiting at the same moment:
+//   byte 0      version (high nibble) | MSG_ACK (low nibble)
+//   byte 1      node address, low byte
+//   byte 2      message id, low byte
+//   bytes 3-4   time (uint16, low 16 bits of the epoch, the node corrects
+//               its own estimate with it)
+//   byte 5      flags, followed by the fields they announce in this order:
+//   ACK_FLAG_EPOCH    epoch (uint32, seconds since 1970), for nodes
+//                     that don't have the time yet
+//   ACK_FLAG_SLOT     slot (uint16, seconds into each reporting period
+//                     at which the node should transmit)
+//   ACK_FLAG_FRAGMENTS  bitmap of the fragments received (uint32, bit n
+//                     for fragment n), answers a fragmented transfer
+//   ACK_FLAG_PHASE    milliseconds into the epoch second at which the ACK
+//                     started going out (uint16, 0-999). Without it the
+//                     node only knows the time to the second, and slots
+//                     have to be at least that plus an ACK airtime apart.
+//   ACK_FLAG_CMD      command (uint8, CMD_*) and its value (uint16), a
+//                     setting the node applies and keeps until told otherwise
+//   ACK_FLAG_RELAY    no field, a relay sent the ACK in the gateway's place
+//                     once the gateway's ACK window passed without one. It
+//                     says nothing about the gateway link or the slot.
+//
+// All multi-byte fields are little endian, regardless of the host.
+// A data frame is 9 bytes on air, the old LoRaMessage struct dump was 32.
+// A plain ACK is 6 bytes, it used to echo the whole 32 byte struct.
+
+#define FRAME_VERSION 2
+
+#define MSG_DATA 0x1
+#define MSG_ACK 0x2
+#define MSG_BATCH 0x3
+#define MSG_SERIES 0x4
+#define MSG_FRAGMENT 0x5
+#define MSG_RELAY 0x6
+#define MSG_UPDATE_REQUEST 0x7
+// downlink, see update.h
+#define MSG_UPDATE_BLOCK 0x8
+#define MSG_STATS 0x9
+
+#define FRAME_HEADER_SIZE 5
+#define FRAME_DATA_SIZE (FRAME_HEADER_SIZE + 4)
+#define FRAME_ACK_SIZE 6
+#define FRAME_ACK_MAX_SIZE (FRAME_ACK_SIZE + 4 + 2 + 4 + 2 + 3)
+#define FRAME_MAX_SIZE 255
+#define FRAME_BATCH_MAX ((FRAME_MAX_SIZE - FRAME_HEADER_SIZE - 3) / 4)
+
+// The fast radio profile uses implicit header mode, so the length of every
+// packet is fixed: uplinks are always data frames, ACKs always carry the
+// full epoch, the slot, the phase (ACK_PHASE_NONE if unknown) and a command
+// (CMD_NONE if there is nothing to do). There are no fragmented transfers,
+// so no fragment bitmap.
+#define FAST_UPLINK_SIZE FRAME_DATA_SIZE
+#define FAST_ACK_SIZE (FRAME_ACK_SIZE + 4 + 2 + 2 + 3)
+
+#define ACK_FLAG_EPOCH 0x01
+#define ACK_FLAG_SLOT 0x02
+#define ACK_FLAG_CMD 0x04
+#define ACK_FLAG_FRAGMENTS 0x08
+#define ACK_FLAG_PHASE 0x10
+#define ACK_FLAG_RELAY 0x20
+
+// Downlink commands, the settings they change persist across deep sleep
+#define CMD_NONE 0x00
+#define CMD_SLEEP_INTERVAL 0x01 // seconds between wakes
+#define CMD_DATA_RATE 0x02      // index into dataRates (link.h), CMD_VALUE_AUTO for ADR
+#define CMD_TX_POWER 0x03       // output power in dBm (int16), CMD_VALUE_AUTO for TPC
+#define CMD_BATCH_SIZE 0x04     // readings collected before an uplink
+#define CMD_DISPLAY_POLICY 0x05 // DISPLAY_* below
+#define CMD_UPDATE 0x06         // firmware update id to fetch (update.h), 0 cancels
+
+// hand the setting back to the node's own link adaptation
+#define CMD_VALUE_AUTO 0xffff
+
+#define DISPLAY_OFF 0
+#define DISPLAY_ON_UPLINK 1 // refresh on every uplink
+#define DISPLAY_ON_CHANGE 2 // refresh on any wake where the shown reading is out of date
+
+// temperature value used when the sensor could not be read
+#define TEMPERATURE_INVALID INT16_MIN
+// no transmit slot assigned
+#define SLOT_NONE 0xffff
+// the sender doesn't know the time to the millisecond
+#define ACK_PHASE_NONE 0xffff
+
+struct FrameHeader
+{
+    uint8_t type;
+    uint16_t address;
+    uint16_t messageId;
+};
+
+struct Sample
+{
+    uint16_t age;
+    int16_t temperature;
+};
+
+inline void putU16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+inline void putU32(uint8_t *p, uint32_t v)
+{
+    putU16(p, v & 0xffff);
+    putU16(p + 2, v >> 16);
+}
+
+inline uint16_t getU16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+inline uint32_t getU32(const uint8_t *p)
+{
+    return (uint32_t)getU16(p) | ((uint32_t)getU16(p + 2) << 16);
+}
+
+// Fold the 48 bit chip id into a 16 bit node address. Folded addresses
+// can collide: among n nodes the odds that two share one are about
+// n^2 / 131072, some 7% for 100 nodes and 50% for 300. Larger fleets
+// should assign addresses instead, see NODE_ADDRESS in main.cpp. The ACK
+// only echoes the low byte, so that has to differ too between nodes that
+// may wait for an ACK at the same moment.
+inline uint16_t nodeAddress(uint64_t chipId)
+{
+    return (uint16_t)(chipId ^ (chipId >> 16) ^ (chipId >> 32));
+}
+
+inline int16_t toCentiDegrees(float temperature)
+{
+    float centi = temperature * 100.0f;
+    if (centi != centi || centi <= INT16_MIN || centi > INT16_MAX)
+    {
+        return TEMPERATURE_INVALID;
+    }
+    return (int16_t)(centi < 0 ? centi - 0.5f : centi + 0.5f);
+}
+
+inline float fromCentiDegrees(int16_t centi)
+{
+    return centi / 100.0f;
+}
+
+inline size_t encodeHeader(uint8_t *buf, const FrameHeader &header)
+{
+    buf[0] = (FRAME_VERSION << 4) | (header.type & 0x0f);
+    putU16(buf + 1, header.address);
+    putU16(buf + 3, header.messageId);
+    return FRAME_HEADER_SIZE;
+}
+
+// Returns false if the buffer is too short or has the wrong version
+inline bool decodeHeader(const uint8_t *buf, size_t len, FrameHeader &header)
+{
+    if (len < FRAME_HEADER_SIZE || (buf[0] >> 4) != FRAME_VERSION)
+    {
+        return false;
+    }
+    header.type = buf[0] & 0x0f;
+    header.address = getU16(buf + 1);
+    header.messageId = getU16(buf + 3);
+    return true;
+}
+
+inline size_t encodeData(uint8_t *buf, uint16_t address, uint16_t messageId, uint16_t epochDelta, int16_t temperature)
+{
+    FrameHeader header = {MSG_DATA, address, messageId};
+    size_t len = encodeHeader(buf, header);
+    putU16(buf + len, epochDelta);
+    putU16(buf + len + 2, (uint16_t)temperature);
+    return FRAME_DATA_SIZE;
+}
+
+inline bool decodeData(const uint8_t *buf, size_t len, FrameHeader &header, uint16_t &epochDelta, int16_t &temperature)
+{
+    if (!decodeHeader(buf, len, header) || header.type != MSG_DATA || len < FRAME_DATA_SIZE)
+    {
+        return false;
+    }
+    epochDelta = getU16(buf + FRAME_HEADER_SIZE);
+    temperature = (int16_t)getU16(buf + FRAME_HEADER_SIZE + 2);
+    return true;
+}
+
+// Optional ACK fields, the ones left at their defaults are not sent
+struct AckFields
+{
+    bool fullEpoch = false;
+    uint16_t slot = SLOT_NONE;
+    bool hasFragments = false;
+    uint32_t fragments = 0;
+    uint16_t phase = ACK_PHASE_NONE;
+    uint8_t cmd = CMD_NONE;
+    uint16_t cmdValue = 0;
+    bool viaRelay = false;
+};
+
+// The fast profile needs fixedLength, which always sends the epoch, the slot, the phase and the command
+inline size_t encodeAck(uint8_t *buf, uint16_t address, uint16_t messageId, uint32_t epoch, const AckFields &fields = AckFields(),
+                        bool fixedLength = false)
+{
+    uint8_t flags = (fields.fullEpoch || fixedLength ? ACK_FLAG_EPOCH : 0) | (fields.slot != SLOT_NONE || fixedLength ? ACK_FLAG_SLOT : 0) |
+                    (fields.hasFragments && !fixedLength ? ACK_FLAG_FRAGMENTS : 0) | (fields.phase != ACK_PHASE_NONE || fixedLength ? ACK_FLAG_PHASE : 0) |
+                    (fields.cmd != CMD_NONE || fixedLength ? ACK_FLAG_CMD : 0) | (fields.viaRelay ? ACK_FLAG_RELAY : 0);
+    buf[0] = (FRAME_VERSION << 4) | MSG_ACK;
+    buf[1] = address & 0xff;
+    buf[2] = messageId & 0xff;
+    putU16(buf + 3, epoch & 0xffff);
+    buf[5] = flags;
+    size_t len = FRAME_ACK_SIZE;
+    if (flags & ACK_FLAG_EPOCH)
+    {
+        putU32(buf + len, epoch);
+        len += 4;
+    }
+    if (flags & ACK_FLAG_SLOT)
+    {
+        putU16(buf + len, fields.slot);
+        len += 2;
+    }
+    if (flags & ACK_FLAG_FRAGMENTS)
+    {
+        putU32(buf + len, fields.fragments);
+        len += 4;
+    }
+    if (flags & ACK_FLAG_PHASE)
+    {
+        putU16(buf + len, fields.phase);
+        len += 2;
+    }
+    if (flags & ACK_FLAG_CMD)
+    {
+        buf[len] = fields.cmd;
+        putU16(buf + len + 1, fields.cmdValue);
+        len += 3;
+    }
+    return len;
+}
+
+// The accessors below read the ACK in place, check it with ackValid() first
+
+inline uint8_t ackFlags(const uint8_t *buf)
+{
+    return buf[5];
+}
+
+// Length the ACK needs according to its flags
+inline size_t ackLength(const uint8_t *buf)
+{
+    return FRAME_ACK_SIZE + (ackFlags(buf) & ACK_FLAG_EPOCH ? 4 : 0) + (ackFlags(buf) & ACK_FLAG_SLOT ? 2 : 0) +
+           (ackFlags(buf) & ACK_FLAG_FRAGMENTS ? 4 : 0) + (ackFlags(buf) & ACK_FLAG_PHASE ? 2 : 0) + (ackFlags(buf) & ACK_FLAG_CMD ? 3 : 0);
+}
+
+inline bool ackValid(const uint8_t *buf, size_t len)
+{
+    return len >= FRAME_ACK_SIZE && buf[0] == ((FRAME_VERSION << 4) | MSG_ACK) && len >= ackLength(buf);
+}
+
+inline bool ackMatches(const uint8_t *buf, uint16_t address, uint16_t messageId)
+{
+    return buf[1] == (address & 0xff) && buf[2] == (messageId & 0xff);
+}
+
+// The epoch, either sent in full or reconstructed from the low 16 bits and
+// the node's own estimate. Returns 0 if the node has no estimate to correct.
+inline uint32_t ackEpoch(const uint8_t *buf, uint32_t estimate)
+{
+    if (ackFlags(buf) & ACK_FLAG_EPOCH)
+    {
+        return getU32(buf + FRAME_ACK_SIZE);
+    }
+    if (estimate == 0)
+    {
+        return 0;
+    }
+    int16_t correction = (int16_t)(getU16(buf + 3) - (uint16_t)estimate);
+    return estimate + correction;
+}
+
+inline uint16_t ackSlot(const uint8_t *buf)
+{
+    if (!(ackFlags(buf) & ACK_FLAG_SLOT))
+    {
+        return SLOT_NONE;
+    }
+    return getU16(buf + FRAME_ACK_SIZE + (ackFlags(buf) & ACK_FLAG_EPOCH ? 4 : 0));
+}
+
+// Fragments the gateway has, a plain ACK means it has all of them
+inline uint32_t ackFragments(const uint8_t *buf)
+{
+    if (!(ackFlags(buf) & ACK_FLAG_FRAGMENTS))
+    {
+        return 0xffffffff;
+    }
+    return getU32(buf + FRAME_ACK_SIZE + (ackFlags(buf) & ACK_FLAG_EPOCH ? 4 : 0) + (ackFlags(buf) & ACK_FLAG_SLOT ? 2 : 0));
+}
+
+// Milliseconds into the epoch second at which the ACK started, ACK_PHASE_NONE if not sent
+inline uint16_t ackPhase(const uint8_t *buf)
+{
+    if (!(ackFlags(buf) & ACK_FLAG_PHASE))
+    {
+        return ACK_PHASE_NONE;
+    }
+    uint16_t phase = getU16(buf + FRAME_ACK_SIZE + (ackFlags(buf) & ACK_FLAG_EPOCH ? 4 : 0) + (ackFlags(buf) & ACK_FLAG_SLOT ? 2 : 0) +
+                            (ackFlags(buf) & ACK_FLAG_FRAGMENTS ? 4 : 0));
+    return phase < 1000 ? phase : ACK_PHASE_NONE;
+}
+
+inline bool ackViaRelay(const uint8_t *buf)
+{
+    return ackFlags(buf) & ACK_FLAG_RELAY;
+}
+
+// The command is the last field, so it sits at the end of the ACK
+inline uint8_t ackCommand(const uint8_t *buf)
+{
+    if (!(ackFlags(buf) & ACK_FLAG_CMD))
+    {
+        return CMD_NONE;
+    }
+    return buf[ackLength(buf) - 3];
+}
+
+inline uint16_t ackCommandValue(const uint8_t *buf)
+{
+    return getU16(buf + ackLength(buf) - 2);
+}
+
+inline size_t encodeBatch(uint8_t *buf, uint16_t address, uint16_t messageId, uint16_t epochDelta, const Sample *samples, uint8_t count)
+{
+    if (count > FRAME_BATCH_MAX)
+    {
+        count = FRAME_BATCH_MAX;
+    }
+    FrameHeader header = {MSG_BATCH, address, messageId};
+    size_t len = encodeHeader(buf, header);
+    buf[len++] = count;
+    putU16(buf + len, epochDelta);
+    len += 2;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        putU16(buf + len, samples[i].age);
+        putU16(buf + len + 2, (uint16_t)samples[i].temperature);
+        len += 4;
+    }
+    return len;
+}
+
+// samples must have room for FRAME_BATCH_MAX entries
+inline bool decodeBatch(const uint8_t *buf, size_t len, FrameHeader &header, uint16_t &epochDelta, Sample *samples, uint8_t &count)
+{
+    if (!decodeHeader(buf, len, header) || header.type != MSG_BATCH || len < FRAME_HEADER_SIZE + 3)
+    {
+        return false;
+    }
+    const uint8_t *p = buf + FRAME_HEADER_SIZE;
+    count = p[0];
+    epochDelta = getU16(p + 1);
+    if (count > FRAME_BATCH_MAX || len < FRAME_HEADER_SIZE + 3 + 4 * (size_t)count)
+    {
+        return false;
+    }
+    p += 3;
+    for (uint8_t i = 0; i < count; i++, p += 4)
+    {
+        samples[i].age = getU16(p);
+        samples[i].temperature = (int16_t)getU16(p + 2);
+    }
+    return true;
+}
+
+// Append a relayed frame to a MSG_RELAY body, returns the new length
+inline size_t appendRelayed(uint8_t *buf, size_t len, uint16_t age, const uint8_t *frame, uint8_t frameLength)
+{
+    putU16(buf + len, age);
+    buf[len + 2] = frameLength;
+    memcpy(buf + len + 3, frame, frameLength);
+    return len + 3 + frameLength;
+}
+
+// Walk the frames in a MSG_RELAY, start with offset at FRAME_HEADER_SIZE.
+// Returns false at the end, or when the rest doesn't make up a whole entry.
+inline bool nextRelayed(const uint8_t *buf, size_t len, size_t &offset, uint16_t &age, const uint8_t *&frame, uint8_t &frameLength)
+{
+    if (offset + 3 > len || offset + 3 + buf[offset + 2] > len)
+    {
+        return false;
+    }
+    age = getU16(buf + offset);
+    frameLength = buf[offset + 2];
+    frame = buf + offset + 3;
+    offset += 3 + frameLength;
+    return true;
+}
+
+// The fast profile has to pay off for our frames on the slowest and the fastest data rate,
+// the fixed size ACK gains less on SF7 where the preamble is a smaller share of the packet
+static_assert(timeOnAirUs(fastProfile(LoRaParams{868.0f, 62.5f, 10, 5, 0x24, 22, 20, false, true}), FAST_UPLINK_SIZE) * 10 <
+                  timeOnAirUs(LoRaParams{868.0f, 62.5f, 10, 5, 0x24, 22, 20, false, true}, FRAME_DATA_SIZE) * 7,
+              "fast profile saves less than 30% on SF10");
+static_assert(timeOnAirUs(fastProfile(LoRaParams{868.0f, 125.0f, 7, 5, 0x24, 22, 20, false, true}), FAST_ACK_SIZE) * 10 <
+                  timeOnAirUs(LoRaParams{868.0f, 125.0f, 7, 5, 0x24, 22, 20, false, true}, FAST_ACK_SIZE) * 8,
+              "fast profile saves less than 20% on SF7");
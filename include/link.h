@@ -0,0 +1,197 @@
+#pragma once
+
+#include <stdint.h>
+
+// Node side link adaptation, driven by the SNR/RSSI of received ACKs.
+// SNR values are kept in quarter dB to stay in integer math.
+//
+// The ACK SNR describes the downlink, sent by the gateway at full power.
+// The path loss is the same both ways, so the uplink margin is the ACK
+// margin minus however far our own output power is below the gateway's.
+
+struct DataRate
+{
+    uint8_t sf;
+    float bw; // kHz
+    // lowest SNR the demodulator copes with, normalised to 62.5 kHz
+    // so that profiles with different bandwidths can be compared
+    int16_t snrFloor;
+    // largest frame we send, longer payloads are fragmented to keep the
+    // airtime of each frame, and what a lost frame costs, in check
+    uint8_t maxPayload;
+};
+
+// From the most robust profile (the one every node starts on) to the fastest.
+// The gateway has to listen on all of them.
+const DataRate dataRates[] = {
+    {10, 62.5, -60, 51},  // -15.0 dB
+    {9, 62.5, -50, 115},  // -12.5 dB
+    {9, 125.0, -38, 115}, // -12.5 dB + 3 dB for the wider bandwidth
+    {8, 125.0, -28, 222}, // -10.0 dB + 3 dB
+    {7, 125.0, -18, 222}, //  -7.5 dB + 3 dB
+};
+
+#define DATA_RATE_COUNT (sizeof(dataRates) / sizeof(dataRates[0]))
+
+// margin above the SNR floor we want to keep, and the extra margin
+// needed before stepping to a faster profile
+#define ADR_MARGIN 32     // 8 dB
+#define ADR_HYSTERESIS 12 // 3 dB
+// ACKs averaged before the first decision on a new profile
+#define ADR_MIN_SAMPLES 3
+// cycles without any ACK before falling back to the robust profile
+#define ADR_FALLBACK_CYCLES 2
+
+// transmit power control range and step, in dBm
+#define TPC_MAX_POWER 22
+#define TPC_MIN_POWER 2
+#define TPC_STEP 3
+
+struct LinkState
+{
+    int16_t snr;  // smoothed SNR, normalised to 62.5 kHz
+    int16_t rssi; // smoothed RSSI in dBm
+    uint8_t dataRate;
+    int8_t power; // output power in dBm
+    uint8_t samples;
+    uint8_t missed; // consecutive cycles without an ACK
+    uint8_t loss;   // smoothed share of attempts without an ACK, in 1/256
+};
+
+// Bandwidth correction in quarter dB, 10 * log10(bw / 62.5) for the bandwidths we use
+inline int16_t bandwidthOffset(float bw)
+{
+    return bw >= 250.0f ? 24 : bw >= 125.0f ? 12 : 0;
+}
+
+inline void linkInit(LinkState &link)
+{
+    link = {};
+    link.power = TPC_MAX_POWER;
+}
+
+// Count one transmission attempt into the loss rate, averaged over about 8 attempts
+inline void linkAttempt(LinkState &link, bool acked)
+{
+    if (acked)
+    {
+        link.loss -= link.loss / 8;
+    }
+    else
+    {
+        link.loss += (256 - link.loss) / 8;
+    }
+}
+
+// Expected uplink margin on the given data rate and output power
+inline int16_t linkMargin(const LinkState &link, uint8_t dataRate, int8_t power)
+{
+    return link.snr - dataRates[dataRate].snrFloor - 4 * (TPC_MAX_POWER - power);
+}
+
+// Feed the SNR (dB) and RSSI (dBm) of an ACK into the link state.
+// A faster data rate is tried first, since it saves airtime on every
+// packet, and the output power is only lowered on the fastest one that
+// works. When the margin gets too small, power goes back up before the
+// data rate is lowered. Returns true if the data rate or power changed.
+inline bool linkAckReceived(LinkState &link, float snr, float rssi)
+{
+    int16_t sample = (int16_t)(snr * 4.0f) + bandwidthOffset(dataRates[link.dataRate].bw);
+    if (link.samples == 0)
+    {
+        link.snr = sample;
+        link.rssi = (int16_t)rssi;
+    }
+    else
+    {
+        link.snr += (sample - link.snr) / 4;
+        link.rssi += ((int16_t)rssi - link.rssi) / 4;
+    }
+    if (link.samples < 255)
+    {
+        link.samples++;
+    }
+    link.missed = 0;
+
+    if (link.samples < ADR_MIN_SAMPLES)
+    {
+        return false;
+    }
+    if (link.dataRate + 1u < DATA_RATE_COUNT && linkMargin(link, link.dataRate + 1, link.power) >= ADR_MARGIN + ADR_HYSTERESIS)
+    {
+        link.dataRate++;
+    }
+    else if (link.power - TPC_STEP >= TPC_MIN_POWER && linkMargin(link, link.dataRate, link.power - TPC_STEP) >= ADR_MARGIN + ADR_HYSTERESIS)
+    {
+        link.power -= TPC_STEP;
+    }
+    else if (linkMargin(link, link.dataRate, link.power) >= ADR_MARGIN)
+    {
+        return false;
+    }
+    else if (link.power < TPC_MAX_POWER)
+    {
+        link.power = link.power + TPC_STEP > TPC_MAX_POWER ? TPC_MAX_POWER : link.power + TPC_STEP;
+    }
+    else if (link.dataRate > 0)
+    {
+        link.dataRate--;
+    }
+    else
+    {
+        return false;
+    }
+    link.samples = 0;
+    return true;
+}
+
+// Call for an ACK a relay sent in the gateway's place. Its SNR is that of
+// the relay, and relays only listen on the most robust data rate, so the
+// data rate and power stay where they are. The uplink got through though.
+inline void linkRelayAck(LinkState &link)
+{
+    link.missed = 0;
+}
+
+// Call after an attempt that got no ACK, the retry goes out a step louder.
+// Returns true if the power changed.
+inline bool linkRetryPower(LinkState &link)
+{
+    if (link.power >= TPC_MAX_POWER)
+    {
+        return false;
+    }
+    link.power = link.power + TPC_STEP > TPC_MAX_POWER ? TPC_MAX_POWER : link.power + TPC_STEP;
+    return true;
+}
+
+// Call once per cycle that ended without an ACK. The output power goes
+// up first, then the data rate down, and after ADR_FALLBACK_CYCLES the
+// node is back on the robust profile at full power.
+// Returns true if the data rate or power changed.
+inline bool linkAckMissed(LinkState &link)
+{
+    if (link.missed < 255)
+    {
+        link.missed++;
+    }
+    link.samples = 0;
+    if (link.missed >= ADR_FALLBACK_CYCLES)
+    {
+        bool changed = link.dataRate != 0 || link.power != TPC_MAX_POWER;
+        link.dataRate = 0;
+        link.power = TPC_MAX_POWER;
+        return changed;
+    }
+    if (link.power < TPC_MAX_POWER)
+    {
+        link.power = link.power + 2 * TPC_STEP > TPC_MAX_POWER ? TPC_MAX_POWER : link.power + 2 * TPC_STEP;
+        return true;
+    }
+    if (link.dataRate > 0)
+    {
+        link.dataRate--;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+// Compressed series of readings (MSG_SERIES), for batches of more than a
+// few samples. Readings come in at a steady rate and change slowly, so
+// instead of 4 bytes per sample only the surprise is sent:
+//   - the age is predicted from the spacing of the two samples before
+//     (delta of delta), a steady rate costs 1 bit per sample
+//   - the temperature is predicted to be the same as the sample before
+//
+// Frame layout after the usual header:
+//   byte 0      sample count (uint8)
+//   byte 1      flags (SERIES_FLAG_*)
+//   bytes 2-3   epoch delta (uint16, as in MSG_DATA)
+//   bytes 4-5   age of the first (oldest) sample (uint16)
+//   bytes 6-7   temperature of the first sample (int16)
+//   then a bit stream, most significant bit first, two codes per
+//   further sample, age first:
+//     0                     same as predicted
+//     10  + short zig-zag   small difference from the prediction
+//     110 + long zig-zag    larger difference
+//     111 + 16 bits         the value itself, for anything else
+//   padded with zero bits to a whole byte.
+//
+// Temperatures are in centi-degrees, or with SERIES_FLAG_SIXTEENTHS in
+// the 1/16 degree steps of the DS18B20, which makes most deltas a 1 or 2.
+// The encoder only picks that when every reading converts back exactly.
+
+#define SERIES_HEADER_SIZE (FRAME_HEADER_SIZE + 8)
+// longest code for one sample, age and temperature both sent in full
+#define SERIES_SAMPLE_MAX_BITS (2 * (3 + 16))
+// most samples a series frame can announce, decoders need room for this many
+#define SERIES_MAX 255
+
+#define SERIES_FLAG_SIXTEENTHS 0x01
+
+// code widths: bits of the short and the long zig-zag value
+#define SERIES_AGE_SHORT_BITS 4
+#define SERIES_AGE_LONG_BITS 9
+#define SERIES_TEMP_SHORT_BITS 3
+#define SERIES_TEMP_LONG_BITS 7
+
+inline uint32_t zigZag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+inline int32_t unZigZag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// centi-degrees to 1/16 degree steps and back, rounded to nearest
+inline int32_t toSixteenths(int16_t centi)
+{
+    return ((int32_t)centi * 16 + (centi < 0 ? -50 : 50)) / 100;
+}
+
+inline int32_t fromSixteenths(int32_t sixteenths)
+{
+    return (sixteenths * 100 + (sixteenths < 0 ? -8 : 8)) / 16;
+}
+
+struct BitWriter
+{
+    uint8_t *buf;
+    size_t bits;
+};
+
+inline void putBits(BitWriter &w, uint32_t value, uint8_t count)
+{
+    while (count--)
+    {
+        uint8_t &byte = w.buf[w.bits / 8];
+        uint8_t mask = 0x80 >> (w.bits % 8);
+        byte = (value >> count) & 1 ? byte | mask : byte & ~mask;
+        w.bits++;
+    }
+}
+
+// raw is the value itself, sent when the difference doesn't fit the long code
+inline void putSeriesCode(BitWriter &w, int32_t value, int32_t predicted, uint16_t raw, uint8_t shortBits, uint8_t longBits)
+{
+    uint32_t z = zigZag(value - predicted);
+    if (z == 0)
+    {
+        putBits(w, 0, 1);
+    }
+    else if (z < (1u << shortBits))
+    {
+        putBits(w, 0x2, 2);
+        putBits(w, z, shortBits);
+    }
+    else if (z < (1u << longBits))
+    {
+        putBits(w, 0x6, 3);
+        putBits(w, z, longBits);
+    }
+    else
+    {
+        putBits(w, 0x7, 3);
+        putBits(w, raw, 16);
+    }
+}
+
+struct BitReader
+{
+    const uint8_t *buf;
+    size_t bits;
+    size_t length; // in bits
+};
+
+// Returns false when reading past the end
+inline bool getBits(BitReader &r, uint8_t count, uint32_t &value)
+{
+    if (r.bits + count > r.length)
+    {
+        return false;
+    }
+    value = 0;
+    while (count--)
+    {
+        value = (value << 1) | ((r.buf[r.bits / 8] >> (7 - r.bits % 8)) & 1);
+        r.bits++;
+    }
+    return true;
+}
+
+// Set signedRaw when the value sent in full is an int16
+inline bool getSeriesCode(BitReader &r, int32_t predicted, bool signedRaw, uint8_t shortBits, uint8_t longBits, int32_t &value)
+{
+    uint32_t bits;
+    uint8_t prefix = 0;
+    while (prefix < 3)
+    {
+        if (!getBits(r, 1, bits))
+        {
+            return false;
+        }
+        if (bits == 0)
+        {
+            break;
+        }
+        prefix++;
+    }
+    if (prefix == 0)
+    {
+        value = predicted;
+        return true;
+    }
+    if (prefix == 3)
+    {
+        if (!getBits(r, 16, bits))
+        {
+            return false;
+        }
+        value = signedRaw ? (int32_t)(int16_t)bits : (int32_t)bits;
+        return true;
+    }
+    if (!getBits(r, prefix == 1 ? shortBits : longBits, bits))
+    {
+        return false;
+    }
+    value = predicted + unZigZag(bits);
+    return true;
+}
+
+// Encode samples, oldest first, into buf. Stops before the frame would grow
+// past capacity, count is set to the number of samples that went in.
+inline size_t encodeSeries(uint8_t *buf, size_t capacity, uint16_t address, uint16_t messageId, uint16_t epochDelta, const Sample *samples,
+                           uint8_t &count)
+{
+    if (count == 0 || capacity < SERIES_HEADER_SIZE)
+    {
+        count = 0;
+        return 0;
+    }
+
+    bool sixteenths = true;
+    for (uint8_t i = 0; i < count && sixteenths; i++)
+    {
+        sixteenths = fromSixteenths(toSixteenths(samples[i].temperature)) == samples[i].temperature;
+    }
+
+    FrameHeader header = {MSG_SERIES, address, messageId};
+    size_t len = encodeHeader(buf, header);
+    buf[len + 1] = sixteenths ? SERIES_FLAG_SIXTEENTHS : 0;
+    putU16(buf + len + 2, epochDelta);
+    putU16(buf + len + 4, samples[0].age);
+    int32_t temperature = sixteenths ? toSixteenths(samples[0].temperature) : samples[0].temperature;
+    putU16(buf + len + 6, (uint16_t)temperature);
+
+    BitWriter w = {buf + SERIES_HEADER_SIZE, 0};
+    size_t capacityBits = (capacity - SERIES_HEADER_SIZE) * 8;
+    int32_t age = samples[0].age;
+    int32_t spacing = 0;
+    uint8_t n = 1;
+    for (; n < count && w.bits + SERIES_SAMPLE_MAX_BITS <= capacityBits; n++)
+    {
+        int32_t nextAge = samples[n].age;
+        putSeriesCode(w, nextAge, age - spacing, samples[n].age, SERIES_AGE_SHORT_BITS, SERIES_AGE_LONG_BITS);
+        spacing = age - nextAge;
+        age = nextAge;
+
+        int32_t nextTemperature = sixteenths ? toSixteenths(samples[n].temperature) : samples[n].temperature;
+        putSeriesCode(w, nextTemperature, temperature, (uint16_t)nextTemperature, SERIES_TEMP_SHORT_BITS, SERIES_TEMP_LONG_BITS);
+        temperature = nextTemperature;
+    }
+    // zero the padding
+    putBits(w, 0, (8 - w.bits % 8) % 8);
+    count = n;
+    buf[len] = n;
+    return SERIES_HEADER_SIZE + w.bits / 8;
+}
+
+// samples must have room for SERIES_MAX entries
+inline bool decodeSeries(const uint8_t *buf, size_t len, FrameHeader &header, uint16_t &epochDelta, Sample *samples, uint8_t &count)
+{
+    if (!decodeHeader(buf, len, header) || header.type != MSG_SERIES || len < SERIES_HEADER_SIZE)
+    {
+        return false;
+    }
+    const uint8_t *p = buf + FRAME_HEADER_SIZE;
+    count = p[0];
+    bool sixteenths = p[1] & SERIES_FLAG_SIXTEENTHS;
+    epochDelta = getU16(p + 2);
+    if (count == 0)
+    {
+        return false;
+    }
+
+    int32_t age = getU16(p + 4);
+    int32_t temperature = (int16_t)getU16(p + 6);
+    samples[0].age = age;
+    samples[0].temperature = sixteenths ? fromSixteenths(temperature) : temperature;
+
+    BitReader r = {buf + SERIES_HEADER_SIZE, 0, (len - SERIES_HEADER_SIZE) * 8};
+    int32_t spacing = 0;
+    for (uint8_t i = 1; i < count; i++)
+    {
+        int32_t nextAge;
+        if (!getSeriesCode(r, age - spacing, false, SERIES_AGE_SHORT_BITS, SERIES_AGE_LONG_BITS, nextAge) ||
+            !getSeriesCode(r, temperature, true, SERIES_TEMP_SHORT_BITS, SERIES_TEMP_LONG_BITS, temperature) || nextAge < 0 || nextAge > 0xffff)
+        {
+            return false;
+        }
+        spacing = age - nextAge;
+        age = nextAge;
+        samples[i].age = age;
+        samples[i].temperature = sixteenths ? fromSixteenths(temperature) : temperature;
+    }
+    return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "frame.h"
+
+// Link quality histograms, kept by the node and reported every so often
+// in a MSG_STATS frame that wraps a regular uplink:
+//   bytes 0-4   header, MSG_STATS, same address and message id as the wrapped frame
+//   8 bytes     ACK RSSI:    < -125, then 10 dB wide bins, >= -65 dBm
+//   8 bytes     ACK SNR:     < -15, then 5 dB wide bins, >= 15 dB
+//   8 bytes     attempts per message, 1 to 7 (7 and more), then failed
+//   8 bytes     ACK latency from the first transmission: < 250 ms, then
+//               doubling, >= 16 s
+//   then the wrapped frame, header and all
+// Every bin is a count (uint8, saturating) since the last report that
+// got through.
+
+#define STATS_BINS 8
+#define STATS_SIZE (4 * STATS_BINS)
+#define STATS_FRAME_OVERHEAD (FRAME_HEADER_SIZE + STATS_SIZE)
+
+struct LinkStats
+{
+    uint8_t rssi[STATS_BINS];
+    uint8_t snr[STATS_BINS];
+    uint8_t attempts[STATS_BINS];
+    uint8_t latency[STATS_BINS];
+};
+
+inline uint8_t statsBin(int32_t value, int32_t low, int32_t width)
+{
+    if (value < low)
+    {
+        return 0;
+    }
+    int32_t bin = 1 + (value - low) / width;
+    return bin >= STATS_BINS ? STATS_BINS - 1 : bin;
+}
+
+inline uint8_t latencyBin(uint32_t ms)
+{
+    uint8_t bin = 0;
+    for (uint32_t limit = 250; bin < STATS_BINS - 1 && ms >= limit; limit *= 2)
+    {
+        bin++;
+    }
+    return bin;
+}
+
+inline void statsCount(uint8_t &bin)
+{
+    if (bin < 255)
+    {
+        bin++;
+    }
+}
+
+inline void statsRecordAck(LinkStats &stats, float rssi, float snr, uint8_t attempts, uint32_t latencyMs)
+{
+    statsCount(stats.rssi[statsBin((int32_t)rssi, -125, 10)]);
+    statsCount(stats.snr[statsBin((int32_t)snr, -15, 5)]);
+    statsCount(stats.attempts[attempts >= STATS_BINS - 1 ? STATS_BINS - 2 : attempts > 0 ? attempts - 1 : 0]);
+    statsCount(stats.latency[latencyBin(latencyMs)]);
+}
+
+inline void statsRecordFailure(LinkStats &stats)
+{
+    statsCount(stats.attempts[STATS_BINS - 1]);
+}
+
+// Wrap the frame in buf (frameLength bytes) into a MSG_STATS frame, in place.
+// buf needs room for STATS_FRAME_OVERHEAD more bytes.
+inline size_t encodeStats(uint8_t *buf, size_t frameLength, const LinkStats &stats)
+{
+    FrameHeader header;
+    decodeHeader(buf, frameLength, header);
+    memmove(buf + STATS_FRAME_OVERHEAD, buf, frameLength);
+    header.type = MSG_STATS;
+    size_t len = encodeHeader(buf, header);
+    memcpy(buf + len, stats.rssi, STATS_BINS);
+    memcpy(buf + len + STATS_BINS, stats.snr, STATS_BINS);
+    memcpy(buf + len + 2 * STATS_BINS, stats.attempts, STATS_BINS);
+    memcpy(buf + len + 3 * STATS_BINS, stats.latency, STATS_BINS);
+    return STATS_FRAME_OVERHEAD + frameLength;
+}
+
+// The wrapped frame starts at buf + STATS_FRAME_OVERHEAD, decode it as usual
+inline bool decodeStats(const uint8_t *buf, size_t len, FrameHeader &header, LinkStats &stats)
+{
+    if (!decodeHeader(buf, len, header) || header.type != MSG_STATS || len < STATS_FRAME_OVERHEAD + FRAME_HEADER_SIZE)
+    {
+        return false;
+    }
+    const uint8_t *p = buf + FRAME_HEADER_SIZE;
+    memcpy(stats.rssi, p, STATS_BINS);
+    memcpy(stats.snr, p + STATS_BINS, STATS_BINS);
+    memcpy(stats.attempts, p + 2 * STATS_BINS, STATS_BINS);
+    memcpy(stats.latency, p + 3 * STATS_BINS, STATS_BINS);
+    return true;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame.h"
+
+// Firmware update over LoRa. The gateway starts it with CMD_UPDATE in an
+// ACK, the value is an id for the image. From then on the node pulls the
+// image one block at a time after its regular uplinks, a few blocks per
+// wake, and keeps its progress in RTC memory.
+//
+// Request, node to gateway:
+//   bytes 0-4   header, MSG_UPDATE_REQUEST, the message id is the block index
+//   bytes 5-6   update id
+// Block index UPDATE_INFO_BLOCK asks for the image info instead of data.
+//
+// Block, gateway to node, addressed like the ACK:
+//   byte 0      version (high nibble) | MSG_UPDATE_BLOCK (low nibble)
+//   byte 1      node address, low byte
+//   bytes 2-3   update id
+//   bytes 4-5   block index
+//   bytes 6-9   CRC (updateCrc32() over the data)
+//   then the data, blockSize bytes, less in the last block
+// The info block carries the image size (uint32), the image CRC (uint32)
+// and the block size (uint16, a multiple of 4 so blocks go straight to flash).
+//
+// The image is a plain or gzip compressed sketch binary, eboot unpacks the
+// latter while copying it into place.
+
+#define UPDATE_REQUEST_SIZE (FRAME_HEADER_SIZE + 2)
+#define UPDATE_BLOCK_HEADER_SIZE 10
+#define UPDATE_INFO_SIZE 10
+#define UPDATE_INFO_BLOCK 0xffff
+
+// Same CRC as calculateCRC32() on the node, MSB first, no final XOR.
+// Start with 0xffffffff and feed the data in as many parts as needed.
+inline uint32_t updateCrc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    while (length--)
+    {
+        uint8_t c = *data++;
+        for (uint32_t i = 0x80; i > 0; i >>= 1)
+        {
+            bool bit = crc & 0x80000000;
+            if (c & i)
+            {
+                bit = !bit;
+            }
+            crc <<= 1;
+            if (bit)
+            {
+                crc ^= 0x04c11db7;
+            }
+        }
+    }
+    return crc;
+}
+
+struct UpdateInfo
+{
+    uint32_t size;
+    uint32_t crc;
+    uint16_t blockSize;
+};
+
+inline size_t encodeUpdateRequest(uint8_t *buf, uint16_t address, uint16_t updateId, uint16_t block)
+{
+    FrameHeader header = {MSG_UPDATE_REQUEST, address, block};
+    size_t len = encodeHeader(buf, header);
+    putU16(buf + len, updateId);
+    return UPDATE_REQUEST_SIZE;
+}
+
+inline size_t encodeUpdateBlock(uint8_t *buf, uint16_t address, uint16_t updateId, uint16_t block, const uint8_t *data, size_t length)
+{
+    buf[0] = (FRAME_VERSION << 4) | MSG_UPDATE_BLOCK;
+    buf[1] = address & 0xff;
+    putU16(buf + 2, updateId);
+    putU16(buf + 4, block);
+    putU32(buf + 6, updateCrc32(0xffffffff, data, length));
+    memcpy(buf + UPDATE_BLOCK_HEADER_SIZE, data, length);
+    return UPDATE_BLOCK_HEADER_SIZE + length;
+}
+
+inline size_t encodeUpdateInfo(uint8_t *buf, uint16_t address, uint16_t updateId, const UpdateInfo &info)
+{
+    uint8_t data[UPDATE_INFO_SIZE];
+    putU32(data, info.size);
+    putU32(data + 4, info.crc);
+    putU16(data + 8, info.blockSize);
+    return encodeUpdateBlock(buf, address, updateId, UPDATE_INFO_BLOCK, data, sizeof(data));
+}
+
+// Checks that buf is the wanted block for this node with an intact CRC,
+// data then points into buf
+inline bool decodeUpdateBlock(const uint8_t *buf, size_t len, uint16_t address, uint16_t updateId, uint16_t block, const uint8_t *&data,
+                              size_t &length)
+{
+    if (len < UPDATE_BLOCK_HEADER_SIZE || buf[0] != ((FRAME_VERSION << 4) | MSG_UPDATE_BLOCK) || buf[1] != (address & 0xff) ||
+        getU16(buf + 2) != updateId || getU16(buf + 4) != block)
+    {
+        return false;
+    }
+    data = buf + UPDATE_BLOCK_HEADER_SIZE;
+    length = len - UPDATE_BLOCK_HEADER_SIZE;
+    return updateCrc32(0xffffffff, data, length) == getU32(buf + 6);
+}
+
+inline bool decodeUpdateInfo(const uint8_t *data, size_t length, UpdateInfo &info)
+{
+    if (length != UPDATE_INFO_SIZE)
+    {
+        return false;
+    }
+    info.size = getU32(data);
+    info.crc = getU32(data + 4);
+    info.blockSize = getU16(data + 8);
+    return info.size > 0 && info.blockSize > 0 && info.blockSize % 4 == 0;
+}
@@ -23,6 +23,13 @@
 
 // include the libraries
 #include <ESP8266WiFi.h>
+#include <coredecls.h>
+#include <flash_hal.h>
+extern "C"
+{
+#include <gpio.h>
+}
+#include <eboot_command.h>
 #include <RadioLib.h>
 #include <time.h>
 #include <TimeLib.h>
@@ -35,6 +42,15 @@
 #include <OneWire.h>
 #include <DallasTemperature.h>
 
+#include "airtime.h"
+#include "frame.h"
+#include "link.h"
+#include "series.h"
+#include "fragment.h"
+#include "update.h"
+#include "dutycycle.h"
+#include "stats.h"
+
 // Data wire is plugged into port 2 on the Arduino
 #define ONE_WIRE_BUS D4
 
@@ -58,15 +74,69 @@ GxEPD2_BW<GxEPD2_213_BN, GxEPD2_213_BN::HEIGHT> display(GxEPD2_213_BN(SCR_CS, SC
 #define LORA_DIO1 D1
 #define LORA_RST D3
 #define LORA_BUSY D2
+// the module's TCXO is powered from DIO3, and needs this long to start
+#define LORA_TCXO_VOLTAGE 2.4
+#define LORA_TCXO_DELAY_US 5000
+
+// SX1262 that can pick up a configuration the chip kept through sleep
+class WarmSX1262 : public SX1262
+{
+public:
+    WarmSX1262(Module *mod) : SX1262(mod)
+    {
+    }
+
+    // The driver side of begin() without reset(), calibration or TCXO start
+    // up: pins, the SX126x SPI framing and the settings RadioLib caches. The
+    // chip has to be in warm sleep with exactly these parameters, after a
+    // power loss it is back on GFSK and RADIOLIB_ERR_WRONG_MODEM comes back.
+    int16_t beginWarm(const LoRaParams &p)
+    {
+        Module *mod = getMod();
+        mod->init();
+        mod->hal->pinMode(mod->getIrq(), mod->hal->GpioModeInput);
+        mod->hal->pinMode(mod->getGpio(), mod->hal->GpioModeInput);
+        mod->SPIreadCommand = RADIOLIB_SX126X_CMD_READ_REGISTER;
+        mod->SPIwriteCommand = RADIOLIB_SX126X_CMD_WRITE_REGISTER;
+        mod->SPInopCommand = RADIOLIB_SX126X_CMD_NOP;
+        mod->SPIstatusCommand = RADIOLIB_SX126X_CMD_GET_STATUS;
+        mod->SPIstreamType = true;
+        mod->SPIparseStatusCb = SX126x::SPIparseStatus;
+
+        // NSS going low wakes the chip
+        int16_t state = standby();
+        RADIOLIB_ASSERT(state);
+        if (getPacketType() != RADIOLIB_SX126X_PACKET_TYPE_LORA)
+        {
+            return RADIOLIB_ERR_WRONG_MODEM;
+        }
+        // the chip still has all of these, the setters only refill the
+        // driver's copies and send a few plain SPI commands
+        state = setTCXO(LORA_TCXO_VOLTAGE, LORA_TCXO_DELAY_US);
+        RADIOLIB_ASSERT(state);
+        state = setBandwidth(p.bw);
+        RADIOLIB_ASSERT(state);
+        state = setSpreadingFactor(p.sf);
+        RADIOLIB_ASSERT(state);
+        state = setCodingRate(p.cr);
+        RADIOLIB_ASSERT(state);
+        state = setCRC(p.crc ? 2 : 0);
+        RADIOLIB_ASSERT(state);
+        state = explicitHeader();
+        RADIOLIB_ASSERT(state);
+        return setPreambleLength(p.preambleLength);
+    }
+};
 
-SX1262 lora = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
+WarmSX1262 lora = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
 
-// flag to indicate that a packet was received
+// flag to indicate that DIO1 fired, either because
+// a transmission finished or a packet was received
 volatile bool receivedFlag = false;
 volatile bool enableInterrupt = true;
 
-// this function is called when a complete packet
-// is received by the module
+// this function is called when a transmission is done
+// or a complete packet is received by the module
 // IMPORTANT: this function MUST be 'void' type
 //            and MUST NOT have any arguments!
 #if defined(ESP8266) || defined(ESP32)
@@ -85,16 +155,143 @@ void setFlag(void)
 uint8_t rfPower = 22;
 const char delimiter = '|';
 
-struct LoRaMessage
-{
-    uint64_t sensorId;
-    uint32_t messageId;
-    time_t epochTime;
-    byte cmd;
-    float temperature;
+LoRaParams radioParams = {
+    868.0, // carrier frequency:           868.0 MHz
+    62.5,  // bandwidth:                   62.5 kHz
+    10,    // spreading factor:            10
+    5,     // coding rate:                 5
+    0x24,  // sync word:                   0x34 (public network/LoRaWAN), 0x24 (private)
+    22,    // output power:                22 dBm, lowered by transmit power control
+    20,    // preamble length:             20 symbols
+    false, // implicit header:             off
+    true,  // CRC:                         on
 };
 
-LoRaMessage loraMessage;
+// opt-in radio profile with implicit header, fixed packet lengths and a short
+// preamble, the gateway has to be set up the same way (see FAST_UPLINK_SIZE)
+#define FAST_RADIO_PROFILE 0
+
+// time the gateway needs between the end of our packet and the start of its ACK
+#define ACK_TURNAROUND_MS 250
+
+// time between two wakes, also the TDMA period when the gateway assigns a slot.
+// This and the other defaults marked below can be changed by the gateway (CMD_*)
+#define SLEEP_SECONDS 60
+// time from the deep sleep wake up to setup(), not covered by uptimeMs()
+#define WAKE_OVERHEAD_MS 150
+
+// transmissions per message before giving up
+#define MAX_ATTEMPTS 5
+
+// run channel activity detection before each transmission and back off while the channel is busy
+#define LISTEN_BEFORE_TALK 1
+// busy channel scans before the attempt counts as failed
+#define LBT_MAX_SCANS 4
+
+// light sleep the MCU while the radio is busy, DIO1 wakes it up
+#define LIGHT_SLEEP_WAITS 1
+// shorter waits use yield(), the SDK wants at least 10 ms for wifi_fpm_do_sleep()
+#define LIGHT_SLEEP_MIN_MS 10
+
+// wait for the ACK in RX duty cycle mode, the radio sleeps between preamble checks
+#define ACK_RX_DUTY_CYCLE 1
+// preamble symbols the radio listens for on each check
+#define ACK_SNIFF_MIN_SYMBOLS 8
+
+// build with e-paper display support, it is refreshed once the radio is done
+#define DISPLAY_ENABLED 0
+// default display refresh policy (DISPLAY_* in frame.h)
+#define DISPLAY_POLICY DISPLAY_ON_UPLINK
+
+// The SCR_* pins are those of the display-only board and clash with the
+// LoRa wiring: CS is the SX1262 NSS (GPIO15), RES the 1-Wire bus (GPIO2),
+// DC the serial TX (GPIO1) and BUSY the SPI MISO (GPIO12). Move them to
+// free pins before turning the display on.
+static_assert(!DISPLAY_ENABLED || (SCR_CS != LORA_CS && SCR_RES != ONE_WIRE_BUS && SCR_DC != TX && SCR_BUSY != MISO),
+              "display pins clash with the radio, the sensor or the serial port");
+
+// start the next temperature conversion right before deep sleep, the wake
+// then only reads the scratchpad. Only used with an externally powered
+// DS18B20, which has to stay powered while the ESP sleeps
+#define CONVERT_IN_SLEEP 1
+
+// default readings collected before the radio is powered, 1 sends every reading right away
+#define BATCH_SIZE 1
+// longest a reading may wait in the batch, in seconds
+#define BATCH_MAX_LATENCY 900
+// readings kept in RTC memory, older ones are dropped when a batch can't be sent
+#define BATCH_MAX 16
+
+// smallest change from the last reported reading that is worth sending,
+// in centi-degrees, 0 reports every reading
+#define DEADBAND 20
+// wakes after which an uplink is forced even if nothing changed
+#define HEARTBEAT_CYCLES 15
+
+static_assert(BATCH_SIZE >= 1 && BATCH_SIZE <= BATCH_MAX, "BATCH_SIZE out of range");
+// send XOR parity fragments with fragmented transfers once the measured
+// loss rate makes them worth their airtime, see parityGroupSize()
+#define FRAGMENT_PARITY_ENABLED 1
+
+// uplinks between two link quality reports (stats.h), 0 turns them off
+#define STATS_INTERVAL 60
+
+// firmware update blocks fetched per wake, after the regular uplink
+#define UPDATE_BLOCKS_PER_WAKE 8
+
+// store-and-forward relay for a mains powered node: never sleeps, listens
+// for nearby nodes on the most robust data rate, ACKs their uplinks and
+// forwards them to the gateway in MSG_RELAY frames along with its own readings
+#define RELAY_ENABLED 0
+// longest a heard frame waits before it is forwarded
+#define RELAY_HOLD_SECONDS 30
+// forward early once this many bytes are waiting. A MSG_RELAY longer than
+// the data rate's maxPayload goes out as a fragmented transfer, like a
+// node's backlog, so no single frame is more than that on air
+#define RELAY_FORWARD_BYTES 160
+#define RELAY_QUEUE_MAX 8
+// recent address/message id pairs, so a node's retry isn't forwarded twice
+#define RELAY_DEDUP_SIZE 32
+// millis() wraps after 49 days, restart well before with the clock carried over
+#define RELAY_RESTART_HOURS 24
+// wait after a forward that got no ACK or was held back by the duty cycle
+// budget, doubling with every further failure up to the maximum
+#define RELAY_RETRY_SECONDS 10
+#define RELAY_RETRY_MAX_SECONDS 600
+
+// nodes keep listening for a relay's ACK after the gateway's ACK window, on
+// the data rate relays listen on (see ackTimeoutMs()). 0 if there are no relays
+#define RELAY_ACK_WINDOW 1
+
+static_assert(!(RELAY_ENABLED && FAST_RADIO_PROFILE), "the relay has to receive uplinks of any length");
+
+// readings that no longer fit the batch wait in flash, behind the copy of
+// SensorData WriteEeprom() keeps, and go out together with the next batch
+#define BACKLOG_EEPROM_OFFSET 512
+#define BACKLOG_MAX (SERIES_MAX - BATCH_MAX)
+
+// a full batch has to fit one series frame even if nothing compresses
+static_assert(SERIES_HEADER_SIZE + ((BATCH_MAX - 1) * SERIES_SAMPLE_MAX_BITS + 7) / 8 <= FRAME_MAX_SIZE, "BATCH_MAX too large");
+
+// message id of the frame in flight, and the last reading
+uint32_t messageId = 0;
+float temperature = DEVICE_DISCONNECTED_C;
+
+// encoded v2 frame, see frame.h
+uint8_t frameBuffer[FRAME_MAX_SIZE];
+// backlog and batch as one series frame, sent in fragments when it is
+// too long for a single frame on the current data rate
+#define TRANSFER_BUFFER_SIZE (SERIES_HEADER_SIZE + ((SERIES_MAX - 1) * SERIES_SAMPLE_MAX_BITS + 7) / 8)
+uint8_t transferBuffer[TRANSFER_BUFFER_SIZE];
+size_t transferLength = 0;
+uint8_t fragmentChunk = 0;
+uint8_t parityGroup = 0;
+// fragments the gateway hasn't confirmed, and the ones still to send in this round
+uint32_t fragmentsMissing = 0;
+uint32_t fragmentsToSend = 0;
+uint32_t parityToSend = 0;
+// received ACK, kept apart so retries can still send frameBuffer
+uint8_t ackBuffer[FRAME_ACK_MAX_SIZE];
 
 // RTC memory structure
 struct RtcData
@@ -103,37 +300,108 @@ struct RtcData
     char data[200];
 };
 
+struct BacklogEntry
+{
+    uint32_t clock;
+    int16_t temperature;
+};
+
+// settings the gateway can change with a downlink command
+struct NodeSettings
+{
+    uint16_t sleepSeconds;
+    uint8_t batchSize;
+    uint8_t displayPolicy;
+    // data rate and output power fixed by the gateway, DATA_RATE_AUTO and
+    // POWER_AUTO leave them to link adaptation
+    uint8_t dataRate;
+    int8_t power;
+};
+
+// firmware update in progress, see update.h
+struct UpdateState
+{
+    uint16_t id; // 0 when there is none
+    uint16_t nextBlock;
+    UpdateInfo info; // size 0 until the info block came in
+};
+
+#define DATA_RATE_AUTO 0xff
+#define POWER_AUTO INT8_MIN
+
+// readings waiting to be sent
+struct Batch
+{
+    uint8_t count;
+    // node clock of the first reading, the others are offsets from it
+    uint32_t firstClock;
+    uint16_t offset[BATCH_MAX];
+    int16_t temperature[BATCH_MAX];
+};
+
 struct SensorData
 {
     uint64_t sensorId;
     uint32_t messageId;
     time_t epochTime;
+    // seconds the node has been running, carried across deep sleep
+    uint32_t clock;
+    // milliseconds on top of clock
+    uint16_t clockFraction;
+    // value of clock, and milliseconds on top, when the epochTime second began
+    uint32_t ackClock;
+    uint16_t ackClockFraction;
+    // transmit slot assigned by the gateway, seconds into each period
+    uint16_t slot;
+    // milliseconds from wake up to the first transmission
+    uint16_t wakeLeadMs;
+    // radioSignature() of the configuration the SX1262 kept in sleep, 0 if none
+    uint32_t radioSignature;
+    // smoothed ACK SNR/RSSI and the data rate picked from them
+    LinkState link;
+    Batch batch;
+    // readings in the flash backlog
+    uint8_t backlogCount;
+    // last reading queued for sending, for the deadband
+    int16_t lastTemperature;
+    // wakes since the radio was last used
+    uint16_t quietCycles;
+    NodeSettings settings;
+    // reading on the display, for DISPLAY_ON_CHANGE
+    int16_t displayedTemperature;
+    UpdateState update;
+    // airtime per EU868 sub-band over the last hour
+    DutyCycleLedger dutyCycle;
+    // link quality since the last report, and uplinks since then
+    LinkStats stats;
+    uint16_t statsCycles;
+    // a conversion was started right before deep sleep, and the node clock
+    // at that point, the reading belongs there rather than to the wake
+    bool conversionPending;
+    uint32_t conversionClock;
 };
 
+// ESP8266 has 512 bytes of RTC user memory
+static_assert(sizeof(SensorData) <= 512, "SensorData doesn't fit in RTC memory");
+
 // RtcData rtcData;
 SensorData sensorData;
 
+// Address on air, 0 derives it from the chip id, which can collide in a
+// large fleet (see nodeAddress()). Set a unique one per node with
+// -D NODE_ADDRESS=0x1234 in build_flags.
+#ifndef NODE_ADDRESS
+#define NODE_ADDRESS 0
+#endif
+
+uint16_t ownAddress()
+{
+    return NODE_ADDRESS != 0 ? NODE_ADDRESS : nodeAddress(sensorData.sensorId);
+}
+
 uint32_t calculateCRC32(const uint8_t *data, size_t length)
 {
-    uint32_t crc = 0xffffffff;
-    while (length--)
-    {
-        uint8_t c = *data++;
-        for (uint32_t i = 0x80; i > 0; i >>= 1)
-        {
-            bool bit = crc & 0x80000000;
-            if (c & i)
-            {
-                bit = !bit;
-            }
-            crc <<= 1;
-            if (bit)
-            {
-                crc ^= 0x04c11db7;
-            }
-        }
-    }
-    return crc;
+    return updateCrc32(0xffffffff, data, length);
 }
 
 void WriteEeprom()
@@ -181,6 +449,224 @@ void readMemory()
     }
 } // counter to keep track of transmitted packets
 
+// time spent in light sleep during this wake, millis() stands still meanwhile
+unsigned long lightSleptMs = 0;
+
+// Milliseconds since this wake started, including light sleep
+unsigned long uptimeMs()
+{
+    return millis() + lightSleptMs;
+}
+
+uint32_t nodeClock()
+{
+    return sensorData.clock + (sensorData.clockFraction + uptimeMs()) / 1000;
+}
+
+uint64_t nodeClockMs()
+{
+    return (uint64_t)sensorData.clock * 1000 + sensorData.clockFraction + uptimeMs();
+}
+
+// The epoch in milliseconds, as far as the last ACK tells
+uint64_t epochMs()
+{
+    uint64_t ackClockMs = (uint64_t)sensorData.ackClock * 1000 + sensorData.ackClockFraction;
+    return (uint64_t)sensorData.epochTime * 1000 + nodeClockMs() - ackClockMs;
+}
+
+// Seconds between the last ACKed epoch and the given node clock, as sent in the v2 frames
+uint16_t epochDelta(uint32_t clock)
+{
+    uint32_t delta = clock - sensorData.ackClock;
+    return delta > 0xffff ? 0xffff : delta;
+}
+
+void addSample(int16_t temperature, uint32_t now)
+{
+    Batch &batch = sensorData.batch;
+    if (batch.count == BATCH_MAX && !FAST_RADIO_PROFILE && sensorData.backlogCount + BATCH_MAX <= BACKLOG_MAX)
+    {
+        // move the full batch to the backlog, one flash write per BATCH_MAX readings
+        for (uint8_t i = 0; i < batch.count; i++)
+        {
+            BacklogEntry entry = {batch.firstClock + batch.offset[i], batch.temperature[i]};
+            EEPROM.put(BACKLOG_EEPROM_OFFSET + (sensorData.backlogCount + i) * sizeof(BacklogEntry), entry);
+        }
+        EEPROM.commit();
+        sensorData.backlogCount += batch.count;
+        batch.count = 0;
+    }
+    if (batch.count == BATCH_MAX)
+    {
+        // the backlog is full too, drop the oldest reading
+        uint16_t shift = batch.offset[1];
+        for (uint8_t i = 1; i < BATCH_MAX; i++)
+        {
+            batch.offset[i - 1] = batch.offset[i] - shift;
+            batch.temperature[i - 1] = batch.temperature[i];
+        }
+        batch.firstClock += shift;
+        batch.count--;
+    }
+    if (batch.count == 0)
+    {
+        batch.firstClock = now;
+    }
+    batch.offset[batch.count] = now - batch.firstClock;
+    batch.temperature[batch.count] = temperature;
+    batch.count++;
+}
+
+// True when the batch is full, or the oldest reading would be too old by the next wake
+bool batchDue()
+{
+    const Batch &batch = sensorData.batch;
+    return batch.count >= sensorData.settings.batchSize || nodeClock() + sensorData.settings.sleepSeconds - batch.firstClock > BATCH_MAX_LATENCY;
+}
+
+Sample samples[SERIES_MAX];
+
+// Fill samples with the backlog and the batch, oldest first
+uint8_t collectSamples()
+{
+    const Batch &batch = sensorData.batch;
+    uint32_t now = nodeClock();
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < sensorData.backlogCount; i++, count++)
+    {
+        BacklogEntry entry;
+        EEPROM.get(BACKLOG_EEPROM_OFFSET + i * sizeof(BacklogEntry), entry);
+        uint32_t age = now - entry.clock;
+        samples[count].age = age > 0xffff ? 0xffff : age;
+        samples[count].temperature = entry.temperature;
+    }
+    for (uint8_t i = 0; i < batch.count; i++, count++)
+    {
+        uint32_t age = now - (batch.firstClock + batch.offset[i]);
+        samples[count].age = age > 0xffff ? 0xffff : age;
+        samples[count].temperature = batch.temperature[i];
+    }
+    return count;
+}
+
+// Encode the pending readings into frameBuffer, a single reading goes out as
+// a plain data frame, more as a compressed series
+size_t encodeRelay(uint8_t *buf);
+
+// set when the frame in flight carries the link quality report
+bool statsSent = false;
+
+size_t encodeFrame()
+{
+#if RELAY_ENABLED
+    return encodeRelay(frameBuffer);
+#endif
+    const Batch &batch = sensorData.batch;
+    uint16_t address = ownAddress();
+    statsSent = false;
+    if (FAST_RADIO_PROFILE)
+    {
+        // the fast profile only carries fixed size data frames, so just the latest reading goes out
+        uint8_t last = batch.count - 1;
+        return encodeData(frameBuffer, address, (uint16_t)messageId, epochDelta(batch.firstClock + batch.offset[last]), batch.temperature[last]);
+    }
+
+    size_t len;
+    if (batch.count == 1 && sensorData.backlogCount == 0)
+    {
+        len = encodeData(frameBuffer, address, (uint16_t)messageId, epochDelta(batch.firstClock + batch.offset[0]), batch.temperature[0]);
+    }
+    else
+    {
+        uint8_t count = collectSamples();
+        len = encodeSeries(frameBuffer, sizeof(frameBuffer), address, (uint16_t)messageId, epochDelta(nodeClock()), samples, count);
+    }
+
+    // piggyback the link quality report when it is due and still fits
+    if (STATS_INTERVAL > 0 && sensorData.statsCycles >= STATS_INTERVAL &&
+        len + STATS_FRAME_OVERHEAD <= dataRates[sensorData.link.dataRate].maxPayload)
+    {
+        len = encodeStats(frameBuffer, len, sensorData.stats);
+        statsSent = true;
+    }
+    return len;
+}
+
+// Data fragments covered by each parity fragment, 0 for none. One parity
+// fragment rebuilds one lost fragment of its group, so the groups get
+// smaller as the loss rate goes up. The loss rate counts missed ACKs too,
+// so it runs at about twice the uplink frame loss.
+uint8_t parityGroupSize(uint8_t loss)
+{
+    if (!FRAGMENT_PARITY_ENABLED || loss < 26) // 10%
+    {
+        return 0;
+    }
+    return loss < 51 ? 8 : loss < 102 ? 4 : 2; // 20%, 40%
+}
+
+// Encode the readings once for the whole wake and decide whether they need
+// a fragmented transfer. The fragments have to stay the same across retries.
+// A relay's MSG_RELAY goes the same way, it can grow to FRAME_MAX_SIZE.
+void prepareTransfer()
+{
+    fragmentsMissing = 0;
+#if RELAY_ENABLED
+    transferLength = encodeRelay(transferBuffer);
+#else
+    if (FAST_RADIO_PROFILE || sensorData.batch.count + sensorData.backlogCount <= 1)
+    {
+        return;
+    }
+    uint8_t count = collectSamples();
+    transferLength = encodeSeries(transferBuffer, sizeof(transferBuffer), ownAddress(), (uint16_t)messageId,
+                                  epochDelta(nodeClock()), samples, count);
+#endif
+    uint8_t maxPayload = dataRates[sensorData.link.dataRate].maxPayload;
+    if (transferLength <= maxPayload)
+    {
+        return;
+    }
+    // room for the length field of the parity fragments
+    fragmentChunk = maxPayload - FRAGMENT_HEADER_SIZE - 2;
+    if (fragmentCount(transferLength, fragmentChunk) > FRAGMENT_MAX)
+    {
+        fragmentChunk = (transferLength + FRAGMENT_MAX - 1) / FRAGMENT_MAX;
+    }
+    uint8_t fragments = fragmentCount(transferLength, fragmentChunk);
+    fragmentsMissing = fragmentMask(fragments);
+    parityGroup = parityGroupSize(sensorData.link.loss);
+    Serial.print("Sending ");
+    Serial.print(transferLength);
+    Serial.print(" bytes in ");
+    Serial.print(fragments);
+    Serial.print(" fragments, ");
+    Serial.print(parityCount(fragments, parityGroup));
+    Serial.println(" parity");
+}
+
+// Encode the next fragment of this round into frameBuffer, data first and
+// parity after it. The last one asks for the ACK.
+size_t nextFragment()
+{
+    uint32_t &pending = fragmentsToSend != 0 ? fragmentsToSend : parityToSend;
+    uint8_t index = 0;
+    while (!(pending & (1UL << index)))
+    {
+        index++;
+    }
+    pending &= ~(1UL << index);
+    bool ackRequest = fragmentsToSend == 0 && parityToSend == 0;
+    if (&pending == &parityToSend)
+    {
+        return encodeParity(frameBuffer, ownAddress(), (uint16_t)messageId, transferBuffer, transferLength,
+                            fragmentChunk, parityGroup, index, ackRequest);
+    }
+    return encodeFragment(frameBuffer, ownAddress(), (uint16_t)messageId, transferBuffer, transferLength,
+                          fragmentChunk, parityGroup, index, ackRequest);
+}
+
 void convertToLocalTime(const char *utcDatetime, char *localDatetime, size_t size, int timeZoneOffset)
 {
     // Parse the input UTC datetime string (format: "YYYY-MM-DD HH:MM:SS")
@@ -288,235 +774,1428 @@ void display_temp(time_t time, float temp)
     } while (display.nextPage());
 }
 
-void initRF()
+void updateDisplay()
 {
-    // initialize the second LoRa instance with
-    // non-default settings
-    // this LoRa link will have high data rate,
-    // but lower range
-    Serial.print(F("[SX1262] Initializing ... "));
-    // carrier frequency:           868.0 MHz
-    float freq = 868.0;
-    // bandwidth:                   125.0 kHz
-    float bw = 62.5;
-    // spreading factor:            10
-    uint8_t sf = 10;
-    // coding rate:                 5
-    uint8_t cr = 5;
-    // sync word:                   0x34 (public network/LoRaWAN), 0x24 (private)
-    uint8_t syncWord = 0x24;
-    // output power:                2 dBm
-    int8_t power = 22;
-    // preamble length:             20 symbols
-    uint16_t preambleLength = 20;
-
-    int state = lora.begin(freq, bw, sf, cr, syncWord, power, preambleLength);
-    if (state == RADIOLIB_ERR_NONE)
-    {
-        Serial.println(F("success!"));
-    }
-    else
-    {
-        Serial.print(F("failed, code "));
-        Serial.println(state);
-        while (true)
-            ;
-    }
+    display.init(115200, true, 50, false);
+    display_temp(sensorData.epochTime, temperature);
+    display.hibernate();
+    sensorData.displayedTemperature = toCentiDegrees(temperature);
+}
 
-    if (lora.setTCXO(2.4) == RADIOLIB_ERR_INVALID_TCXO_VOLTAGE)
+// The display shows one decimal, so smaller changes don't need a refresh
+bool displayDue(bool uplink)
+{
+    switch (sensorData.settings.displayPolicy)
     {
-        Serial.println(F("Selected TCXO voltage is invalid for this module!"));
+    case DISPLAY_ON_UPLINK:
+        return uplink;
+    case DISPLAY_ON_CHANGE:
+        return abs((int32_t)toCentiDegrees(temperature) - sensorData.displayedTemperature) >= 10;
+    default:
+        return false;
     }
+}
+
+// Set radioParams up for the data rate and power in the link state
+void applyLinkParams()
+{
+    // use the data rate picked from earlier ACKs
+    const DataRate &dr = dataRates[sensorData.link.dataRate];
+    radioParams.sf = dr.sf;
+    radioParams.bw = dr.bw;
+    // and the output power from transmit power control
+    rfPower = sensorData.link.power;
+    radioParams.power = rfPower;
+#if FAST_RADIO_PROFILE
+    radioParams = fastProfile(radioParams);
+#endif
+}
 
-    // set the function that will be called
-    // when new packet is received
-    lora.setPacketReceivedAction(setFlag);
+// Fingerprint of the radio configuration, kept in RTC memory while the
+// SX1262 sleeps with its configuration retained
+uint32_t radioSignature()
+{
+    const LoRaParams &p = radioParams;
+    uint16_t freq = p.freq * 10;
+    uint16_t bw = p.bw * 10;
+    uint8_t config[] = {0x5a, (uint8_t)freq, (uint8_t)(freq >> 8), (uint8_t)bw, (uint8_t)(bw >> 8), p.sf, p.cr, p.syncWord,
+                        (uint8_t)p.power, (uint8_t)p.preambleLength, (uint8_t)(p.preambleLength >> 8), p.implicitHeader, p.crc};
+    return calculateCRC32(config, sizeof(config));
+}
 
-    // start listening for LoRa packets
-    Serial.print(F("[SX1262] Starting to listen ... "));
-    state = lora.startReceive();
-    if (state == RADIOLIB_ERR_NONE)
+void initRF()
+{
+    applyLinkParams();
+    const LoRaParams &p = radioParams;
+
+    // warm start only if we come out of deep sleep and the radio was put
+    // to sleep with exactly this configuration
+    bool warm = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE && sensorData.radioSignature == radioSignature();
+    sensorData.radioSignature = 0;
+    int state = RADIOLIB_ERR_UNKNOWN;
+    if (warm)
     {
-        Serial.println(F("success!"));
+        Serial.print(F("[SX1262] Warm start ... "));
+        state = lora.beginWarm(p);
+        if (state == RADIOLIB_ERR_NONE)
+        {
+            Serial.println(F("success!"));
+        }
+        else
+        {
+            Serial.print(F("failed, code "));
+            Serial.println(state);
+        }
     }
-    else
+
+    if (state != RADIOLIB_ERR_NONE)
     {
-        Serial.print(F("failed, code "));
-        Serial.println(state);
-        while (true)
+        // initialize the second LoRa instance with
+        // non-default settings
+        // this LoRa link will have high data rate,
+        // but lower range
+        Serial.print(F("[SX1262] Initializing ... "));
+        state = lora.begin(p.freq, p.bw, p.sf, p.cr, p.syncWord, p.power, p.preambleLength);
+        if (state == RADIOLIB_ERR_NONE)
+        {
+            Serial.println(F("success!"));
+        }
+        else
         {
-            delay(10);
+            Serial.print(F("failed, code "));
+            Serial.println(state);
+            while (true)
+                ;
+        }
+
+        if (lora.setTCXO(LORA_TCXO_VOLTAGE, LORA_TCXO_DELAY_US) == RADIOLIB_ERR_INVALID_TCXO_VOLTAGE)
+        {
+            Serial.println(F("Selected TCXO voltage is invalid for this module!"));
         }
     }
+
+    // set the function that will be called when a
+    // transmission is done or a new packet is received
+    lora.setDio1Action(setFlag);
+
+#if FAST_RADIO_PROFILE
+    // packets we receive are always ACKs, we pass the length when transmitting
+    lora.implicitHeader(FAST_ACK_SIZE);
+#endif
 }
 
-float getTemperature()
+// Radio state machine, driven by the DIO1 interrupt.
+// radioStart() kicks off the first transmission and radioPoll()
+// advances the state whenever the interrupt has fired or a timer
+// has run out, so loop() is free to do other work in between.
+enum RadioState
 {
-    // Send the command to get temperatures
-    Serial.print("Requesting temperatures...");
-    sensors.requestTemperatures();
-    Serial.println("DONE");
-    // Get the temperature in Celsius
-    float tempC = sensors.getTempCByIndex(0);
-    Serial.print("Temperature for the device 1 (index 0) is: ");
-    Serial.println(tempC);
-    return tempC;
-}
+    RADIO_IDLE,
+    RADIO_CAD,
+    RADIO_BACKOFF,
+    RADIO_TX,
+    RADIO_WAIT_ACK,
+    RADIO_RETRY,
+    RADIO_DONE
+};
 
-void setup()
+// slack on top of the computed airtime before giving up on the DIO1 interrupt
+#define RADIO_GUARD_MS 100
+// retry backoff grows up to 2^BACKOFF_MAX_EXPONENT attempt durations
+#define BACKOFF_MAX_EXPONENT 2
+
+RadioState radioState = RADIO_IDLE;
+// set once initRF() ran during this wake
+bool radioActive = false;
+int radioAttempt = 0;
+unsigned long radioTimer = 0;
+unsigned long retryDelay = 0;
+bool ackReceived = false;
+// signal of the last ACK, and the time from the first transmission to it
+float ackRssi = 0;
+float ackSnr = 0;
+unsigned long ackLatencyMs = 0;
+int channelScans = 0;
+unsigned long scanBackoff = 0;
+size_t frameLength = 0;
+
+// radio usage during this wake, for the per-cycle report
+uint32_t txAirtimeUs = 0;
+uint32_t rxTimeUs = 0;
+// time the radio slept in RX duty cycle mode instead of listening
+uint32_t rxSavedUs = 0;
+
+// Check a transmission against the duty cycle budget of our sub-band
+bool airtimeAllowed(uint32_t airtimeUs)
 {
-    // initialize the serial port
-    Serial.begin(9600);
-    while (!Serial)
-        delay(10); // wait for Serial to be initialized
+    dutyCycleAdvance(sensorData.dutyCycle, nodeClock());
+    return dutyCycleAllows(sensorData.dutyCycle, subBandIndex(radioParams.freq), airtimeUs);
+}
 
-    pinMode(RX, OUTPUT);
-    digitalWrite(RX, HIGH);
+// Count a transmission that went out, for the per-cycle report and the duty cycle
+void chargeAirtime(uint32_t airtimeUs)
+{
+    txAirtimeUs += airtimeUs;
+    dutyCycleAdvance(sensorData.dutyCycle, nodeClock());
+    dutyCycleCharge(sensorData.dutyCycle, subBandIndex(radioParams.freq), airtimeUs);
+}
 
-    // Read struct from RTC memory
-    readMemory();
-    // readSensorDataFromRtc(sensorData, sensorData);
-    Serial.println("Data stored in RTC memory: ");
-    Serial.print("Sensor ID: ");
-    Serial.println(sensorData.sensorId);
-    Serial.print("Message ID: ");
-    Serial.println(sensorData.messageId);
-    Serial.print("Datetime: ");
-    Serial.println(sensorData.epochTime);
+// Longest we have to listen for the gateway's ACK after our packet went out:
+// the turnaround, the ACK time on air and two symbols of timing slack
+unsigned long ackWindowMs()
+{
+    return ACK_TURNAROUND_MS + (timeOnAirUs(radioParams, FRAME_ACK_MAX_SIZE) + 2 * symbolTimeUs(radioParams)) / 1000 + 1;
+}
 
-    // Initialize the sensor ID if it's not set
-    uint64_t chipId = getChipId();
-    if (sensorData.sensorId != chipId)
-    {
-        Serial.println("Sensor ID not set, initializing...");
-        Serial.print("Chip ID: ");
-        Serial.println(chipId);
-        Serial.print("Chip ID (HEX): ");
-        Serial.println(chipId, HEX);
-        sensorData.sensorId = chipId;
-        sensorData.messageId = 0;
-        sensorData.epochTime = 0;
-        // writeSensorDataToRtc(sensorData, sensorData);
-        writeMemory();
-    }
+// A relay only answers once the gateway's window passed without its ACK,
+// so on the data rate relays listen on a second window follows
+unsigned long ackTimeoutMs()
+{
+    bool relayHears = radioParams.sf == dataRates[0].sf && radioParams.bw == dataRates[0].bw;
+    return !RELAY_ENABLED && RELAY_ACK_WINDOW && relayHears ? 2 * ackWindowMs() : ackWindowMs();
+}
 
-    delay(1000);
-    initRF();
-    // Start up the library
-    sensors.begin();
+unsigned long cadTimeoutMs()
+{
+    return (4 * symbolTimeUs(radioParams)) / 1000 + RADIO_GUARD_MS;
 }
 
-int count = 0;
+unsigned long txTimeoutMs()
+{
+    return timeOnAirUs(radioParams, frameLength) / 1000 + RADIO_GUARD_MS;
+}
 
-void loop()
+// Truncated exponential backoff with jitter, measured in attempt
+// durations so it scales with the data rate in use
+unsigned long retryBackoffMs()
 {
-    bool ackReceived = false;
-    sensorData.messageId++;
+    unsigned long slot = timeOnAirUs(radioParams, frameLength) / 1000 + ackTimeoutMs();
+    int exponent = radioAttempt < BACKOFF_MAX_EXPONENT ? radioAttempt : BACKOFF_MAX_EXPONENT;
+    unsigned long window = slot << exponent;
+    return window / 2 + random(window / 2 + 1);
+}
 
-    loraMessage.sensorId = sensorData.sensorId;
-    loraMessage.messageId = sensorData.messageId;
-    loraMessage.epochTime = sensorData.epochTime;
-    loraMessage.cmd = 0x00;
-    loraMessage.temperature = getTemperature(); //(float)random(0, 2500) / 100;
+// set while the ACK wait runs in RX duty cycle mode
+bool ackSniffing = false;
 
-    // Loop to attempt transmission up to maxRetransmissions times
-    for (int attempt = 0; attempt < 5; attempt++)
+int16_t startAckReceive()
+{
+    ackSniffing = false;
+#if ACK_RX_DUTY_CYCLE
+    SniffTiming sniff = sniffTiming(radioParams, ACK_SNIFF_MIN_SYMBOLS, LORA_TCXO_DELAY_US);
+    if (sniff.sleepUs > 0)
     {
-        unsigned long randomDelay = random(500, 5000);
-
-        // Send the message
-        uint8_t *dataPtr = (uint8_t *)&loraMessage;
-        int16_t state = lora.transmit(dataPtr, sizeof(LoRaMessage));
-
+        int16_t state = lora.startReceiveDutyCycle(sniff.rxUs, sniff.sleepUs);
         if (state == RADIOLIB_ERR_NONE)
         {
-            Serial.println("Message sent successfully, waiting for ACK...");
-
-            // Switch to receive mode and wait for acknowledgment
-            // Read the incoming message
-            unsigned long start = millis();
+            ackSniffing = true;
+            return state;
+        }
+        // still listen, just without the sleep
+        Serial.print("RX duty cycle failed, code: ");
+        Serial.println(state);
+    }
+#endif
+    return lora.startReceive();
+}
 
-            int16_t receiveState = -1;
-            Serial.println(F("Waiting for ACK..."));
-            do
-            {
-                receiveState = lora.receive((uint8_t *)&loraMessage, sizeof(LoRaMessage));
-                Serial.print("State: ");
-                Serial.println(receiveState);
-                if (millis() - start > randomDelay)
-                {
-                    Serial.println("Timeout waiting for ACK.");
-                    break;
-                }
-            } while (receiveState < 0);
+// Add the ACK wait that just ended to the RX time. In duty cycle mode
+// only the listening share of it draws RX current, roughly.
+void countRxTime()
+{
+    uint32_t waitUs = (uptimeMs() - radioTimer) * 1000;
+    uint32_t listenUs = waitUs;
+    if (ackSniffing)
+    {
+        SniffTiming sniff = sniffTiming(radioParams, ACK_SNIFF_MIN_SYMBOLS, LORA_TCXO_DELAY_US);
+        listenUs = (uint64_t)waitUs * sniff.rxUs / (sniff.rxUs + sniff.sleepUs);
+    }
+    rxTimeUs += listenUs;
+    rxSavedUs += waitUs - listenUs;
+}
 
-            if (receiveState >= 0)
-            {
-                Serial.print("Received ACK: ");
-                Serial.print("Sensor ID: ");
-                Serial.println(loraMessage.sensorId);
-                Serial.print("Message ID: ");
-                Serial.println(loraMessage.messageId);
-                Serial.print("Command: ");
-                Serial.println(loraMessage.cmd);
-                Serial.print("Payload: ");
-                Serial.println(loraMessage.temperature);
-
-                // Check if the received ACK matches this sensor and message
-                if (loraMessage.sensorId == sensorData.sensorId && loraMessage.messageId == sensorData.messageId && loraMessage.cmd == 0xFF)
-                {
-                    Serial.println("Correct ACK received with datetime!");
+// The ACK went missing, maybe because the uplink didn't make it, so the
+// retry goes out a step louder unless the gateway fixed the power.
+// Called with the radio in standby. Only the power changes, an ACK earlier
+// in this wake may have moved link.dataRate, but the radio stays on the
+// SF/BW it was set up with until the next initRF().
+void raiseRetryPower()
+{
+    if (sensorData.settings.power != POWER_AUTO || !linkRetryPower(sensorData.link))
+    {
+        return;
+    }
+    rfPower = sensorData.link.power;
+    radioParams.power = rfPower;
+    lora.setOutputPower(radioParams.power);
+    Serial.print("Retrying at ");
+    Serial.print(radioParams.power);
+    Serial.println(" dBm");
+}
 
-                    // Store the received datetime and ticks in RTC memory
-                    sensorData.epochTime = loraMessage.epochTime;
+void scheduleRetry()
+{
+    lora.standby();
+    retryDelay = retryBackoffMs();
+    radioTimer = uptimeMs();
+    radioState = RADIO_RETRY;
+}
 
-                    // Mark ACK as received and break loop
-                    ackReceived = true;
-                    break;
-                }
-                else
-                {
-                    Serial.println("Incorrect ACK received or ID mismatch.");
-                }
+void startTransmit()
+{
+    if (!airtimeAllowed(timeOnAirUs(radioParams, frameLength)))
+    {
+        // the rest of the message waits for the next wake
+        Serial.println("Duty cycle budget used up, not transmitting.");
+        lora.standby();
+        radioState = RADIO_DONE;
+        return;
+    }
+    receivedFlag = false;
+    int16_t state = lora.startTransmit(frameBuffer, frameLength);
+    radioTimer = uptimeMs();
+    if (state == RADIOLIB_ERR_NONE)
+    {
+        chargeAirtime(timeOnAirUs(radioParams, frameLength));
+        radioState = RADIO_TX;
+    }
+    else
+    {
+        Serial.print("Error transmitting message, code: ");
+        Serial.println(state);
+        scheduleRetry();
+    }
+}
+
+// Listen for a LoRa preamble on the channel, DIO1 fires once the scan is done
+void startChannelScan()
+{
+    receivedFlag = false;
+    int16_t state = lora.startChannelScan();
+    radioTimer = uptimeMs();
+    if (state == RADIOLIB_ERR_NONE)
+    {
+        radioState = RADIO_CAD;
+    }
+    else
+    {
+        // can't tell, just go ahead
+        startTransmit();
+    }
+}
+
+// Send frameBuffer, after listening first if enabled
+void startFrame()
+{
+#if LISTEN_BEFORE_TALK
+    channelScans = 0;
+    startChannelScan();
+#else
+    startTransmit();
+#endif
+}
+
+void startAttempt()
+{
+    if (fragmentsMissing != 0)
+    {
+        // every fragment the gateway hasn't confirmed goes out again,
+        // parity only in the first round when it still has everything to cover
+        fragmentsToSend = fragmentsMissing;
+        parityToSend = fragmentsMissing == fragmentMask(fragmentCount(transferLength, fragmentChunk))
+                           ? fragmentMask(parityCount(fragmentCount(transferLength, fragmentChunk), parityGroup))
+                           : 0;
+        frameLength = nextFragment();
+    }
+    else
+    {
+        // Send the message
+        frameLength = encodeFrame();
+    }
+    startFrame();
+}
+
+void radioStart()
+{
+    sensorData.wakeLeadMs = uptimeMs();
+    ackReceived = false;
+    radioAttempt = 0;
+    prepareTransfer();
+    startAttempt();
+}
+
+// Keep the data rate and power the gateway fixed, whatever link adaptation decided
+void applyFixedLink()
+{
+    const NodeSettings &settings = sensorData.settings;
+    if (settings.dataRate != DATA_RATE_AUTO)
+    {
+        sensorData.link.dataRate = settings.dataRate;
+    }
+    if (settings.power != POWER_AUTO)
+    {
+        sensorData.link.power = settings.power;
+    }
+}
+
+// Apply a downlink command, the new setting is kept in RTC memory
+void applyCommand(uint8_t cmd, uint16_t value)
+{
+    NodeSettings &settings = sensorData.settings;
+    switch (cmd)
+    {
+    case CMD_NONE:
+        return;
+    case CMD_SLEEP_INTERVAL:
+    {
+        // at least long enough for a full cycle on the slowest data rate, and
+        // short enough that a wake aimed at the slot after next (up to 1.5
+        // periods, see sleepDurationMs()) stays within ESP.deepSleepMax()
+        uint16_t longest = ESP.deepSleepMax() / 1500000;
+        settings.sleepSeconds = value < 10 ? 10 : value > longest ? longest : value;
+        break;
+    }
+    case CMD_DATA_RATE:
+        settings.dataRate = value < DATA_RATE_COUNT ? value : DATA_RATE_AUTO;
+        // the smoothed SNR belongs to the old data rate
+        sensorData.link.samples = 0;
+        break;
+    case CMD_TX_POWER:
+        if (value == CMD_VALUE_AUTO)
+        {
+            settings.power = POWER_AUTO;
+        }
+        else
+        {
+            int16_t power = (int16_t)value;
+            settings.power = power < TPC_MIN_POWER ? TPC_MIN_POWER : power > TPC_MAX_POWER ? TPC_MAX_POWER : power;
+        }
+        break;
+    case CMD_BATCH_SIZE:
+        settings.batchSize = value < 1 ? 1 : value > BATCH_MAX ? BATCH_MAX : value;
+        break;
+    case CMD_DISPLAY_POLICY:
+        settings.displayPolicy = value <= DISPLAY_ON_CHANGE ? value : DISPLAY_OFF;
+        break;
+    case CMD_UPDATE:
+        if (value != sensorData.update.id)
+        {
+            // a new image, or a cancel, drops whatever was fetched so far
+            sensorData.update = {};
+            sensorData.update.id = value;
+        }
+        break;
+    default:
+        Serial.print("Unknown command: ");
+        Serial.println(cmd);
+        return;
+    }
+    applyFixedLink();
+    Serial.print("Command ");
+    Serial.print(cmd);
+    Serial.print(" applied, value: ");
+    Serial.println(value);
+}
+
+void printLink()
+{
+    Serial.print("Link changed to data rate ");
+    Serial.print(sensorData.link.dataRate);
+    Serial.print(", ");
+    Serial.print(sensorData.link.power);
+    Serial.println(" dBm");
+}
+
+// Returns true if the packet in the radio buffer is the ACK for the current message
+bool readAck()
+{
+    int16_t state = lora.readData(ackBuffer, sizeof(ackBuffer));
+    if (state != RADIOLIB_ERR_NONE)
+    {
+        Serial.print("Error receiving ACK, code: ");
+        Serial.println(state);
+        return false;
+    }
+
+    // Check if the received ACK matches this sensor and message, anything
+    // longer than the largest ACK is somebody else's uplink
+    size_t length = lora.getPacketLength();
+    if (length > sizeof(ackBuffer) || !ackValid(ackBuffer, length) || !ackMatches(ackBuffer, ownAddress(), (uint16_t)messageId))
+    {
+        Serial.println("Incorrect ACK received or ID mismatch.");
+        return false;
+    }
+
+    uint32_t estimate = sensorData.epochTime == 0 ? 0 : epochMs() / 1000;
+    uint32_t epoch = ackEpoch(ackBuffer, estimate);
+    Serial.print("Correct ACK received, epoch: ");
+    Serial.print(epoch);
+    Serial.print(", correction: ");
+    Serial.println((int32_t)(epoch - estimate));
+
+    // Store the received datetime and ticks in RTC memory, anchored to the
+    // node clock at the start of that epoch second: the ACK started going
+    // out phase ms into it and has been on air since. Without the phase
+    // the anchor is only good to a second.
+    if (epoch != 0)
+    {
+        uint16_t phase = ackPhase(ackBuffer);
+        uint64_t startMs = nodeClockMs() - timeOnAirUs(radioParams, length) / 1000 - (phase != ACK_PHASE_NONE ? phase : 0);
+        sensorData.epochTime = epoch;
+        sensorData.ackClock = startMs / 1000;
+        sensorData.ackClockFraction = startMs % 1000;
+    }
+    // a relay's ACK doesn't know about slots, keep ours
+    bool viaRelay = ackViaRelay(ackBuffer);
+    if (!viaRelay)
+    {
+        sensorData.slot = ackSlot(ackBuffer);
+    }
+    applyCommand(ackCommand(ackBuffer), ackCommandValue(ackBuffer));
+
+    float snr = lora.getSNR();
+    float rssi = lora.getRSSI();
+    ackSnr = snr;
+    ackRssi = rssi;
+    ackLatencyMs = uptimeMs() - sensorData.wakeLeadMs;
+    Serial.print("SNR: ");
+    Serial.print(snr);
+    Serial.print(" dB, RSSI: ");
+    Serial.print(rssi);
+    Serial.println(viaRelay ? " dBm, via relay" : " dBm");
+    if (viaRelay)
+    {
+        linkRelayAck(sensorData.link);
+        return true;
+    }
+    bool changed = linkAckReceived(sensorData.link, snr, rssi);
+    applyFixedLink();
+    if (changed)
+    {
+        printLink();
+    }
+    return true;
+}
+
+void radioPoll()
+{
+    bool event = receivedFlag;
+    if (event)
+    {
+        enableInterrupt = false;
+        receivedFlag = false;
+    }
+
+    switch (radioState)
+    {
+    case RADIO_CAD:
+        if (event)
+        {
+            channelScans++;
+            if (lora.getChannelScanResult() == RADIOLIB_CHANNEL_FREE)
+            {
+                startTransmit();
+            }
+            else if (channelScans >= LBT_MAX_SCANS)
+            {
+                Serial.println("Channel busy, giving up on this attempt.");
+                scheduleRetry();
+            }
+            else
+            {
+                // somebody else is talking, wait for roughly one of our packets
+                unsigned long airtime = timeOnAirUs(radioParams, frameLength) / 1000;
+                Serial.println("Channel busy, backing off...");
+                lora.standby();
+                scanBackoff = random(airtime / 2, airtime * 2);
+                radioTimer = uptimeMs();
+                radioState = RADIO_BACKOFF;
+            }
+        }
+        else if (uptimeMs() - radioTimer > cadTimeoutMs())
+        {
+            lora.standby();
+            startTransmit();
+        }
+        break;
+
+    case RADIO_BACKOFF:
+        if (uptimeMs() - radioTimer > scanBackoff)
+        {
+            startChannelScan();
+        }
+        break;
+
+    case RADIO_TX:
+        if (event)
+        {
+            lora.finishTransmit();
+            if (fragmentsToSend != 0 || parityToSend != 0)
+            {
+                // the rest of the round goes out before the ACK
+                frameLength = nextFragment();
+                startFrame();
+                break;
+            }
+            Serial.println("Message sent successfully, waiting for ACK...");
+            // Switch to receive mode and wait for acknowledgment
+            int16_t state = startAckReceive();
+            radioTimer = uptimeMs();
+            if (state == RADIOLIB_ERR_NONE)
+            {
+                radioState = RADIO_WAIT_ACK;
             }
             else
             {
-                Serial.print("Error receiving ACK, code: ");
-                Serial.println(receiveState);
+                scheduleRetry();
+            }
+        }
+        else if (uptimeMs() - radioTimer > txTimeoutMs())
+        {
+            Serial.println("Timeout transmitting message.");
+            scheduleRetry();
+        }
+        break;
+
+    case RADIO_WAIT_ACK:
+        if (event)
+        {
+            if (readAck())
+            {
+                lora.standby();
+                countRxTime();
+                linkAttempt(sensorData.link, true);
+                fragmentsMissing &= ~ackFragments(ackBuffer);
+                if (fragmentsMissing != 0)
+                {
+                    // only the lost fragments go out again, right away
+                    Serial.println("Fragments missing, resending them...");
+                    radioAttempt++;
+                    if (radioAttempt >= MAX_ATTEMPTS)
+                    {
+                        radioState = RADIO_DONE;
+                    }
+                    else
+                    {
+                        startAttempt();
+                    }
+                    break;
+                }
+                ackReceived = true;
+                radioState = RADIO_DONE;
+                break;
+            }
+            // not our ACK, a duty cycled receive stops after any packet
+            startAckReceive();
+        }
+        if (uptimeMs() - radioTimer > ackTimeoutMs())
+        {
+            Serial.println("Timeout waiting for ACK.");
+            countRxTime();
+            linkAttempt(sensorData.link, false);
+            scheduleRetry();
+            raiseRetryPower();
+        }
+        break;
+
+    case RADIO_RETRY:
+        // If ACK not received, back off before retrying
+        if (radioAttempt + 1 >= MAX_ATTEMPTS)
+        {
+            radioState = RADIO_DONE;
+        }
+        else if (!airtimeAllowed(timeOnAirUs(radioParams, frameLength)))
+        {
+            Serial.println("Duty cycle budget used up, skipping the retry.");
+            radioState = RADIO_DONE;
+        }
+        else if (uptimeMs() - radioTimer > retryDelay)
+        {
+            Serial.println("No ACK received, retrying...");
+            radioAttempt++;
+            startAttempt();
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    enableInterrupt = true;
+}
+
+// Milliseconds until radioPoll() has anything to do, unless DIO1 fires first
+unsigned long radioIdleMs()
+{
+    unsigned long timeout;
+    switch (radioState)
+    {
+    case RADIO_CAD:
+        timeout = cadTimeoutMs();
+        break;
+    case RADIO_BACKOFF:
+        timeout = scanBackoff;
+        break;
+    case RADIO_TX:
+        timeout = txTimeoutMs();
+        break;
+    case RADIO_WAIT_ACK:
+        timeout = ackTimeoutMs();
+        break;
+    case RADIO_RETRY:
+        timeout = radioAttempt + 1 >= MAX_ATTEMPTS ? 0 : retryDelay;
+        break;
+    default:
+        return 0;
+    }
+    unsigned long elapsed = uptimeMs() - radioTimer;
+    return receivedFlag || elapsed > timeout ? 0 : timeout - elapsed + 1;
+}
+
+volatile bool lightSleepWoke = false;
+
+void lightSleepWakeup()
+{
+    lightSleepWoke = true;
+    esp_schedule();
+}
+
+// Forced light sleep for up to timeoutMs, or until DIO1 goes high.
+// The CPU stops and the sketch resumes right here afterwards.
+void lightSleep(unsigned long timeoutMs)
+{
+    if (timeoutMs < LIGHT_SLEEP_MIN_MS || digitalRead(LORA_DIO1) == HIGH)
+    {
+        yield();
+        return;
+    }
+
+    // anything still in the UART FIFO would be lost
+    Serial.flush();
+    // forced light sleep needs the WiFi off, like ESP.forcedLightSleepBegin() does it
+    uint8_t opmode = wifi_get_opmode();
+    wifi_set_opmode_current(NULL_MODE);
+    uint32_t rtcStart = system_get_rtc_time();
+    unsigned long millisStart = millis();
+    lightSleepWoke = false;
+    wifi_fpm_set_sleep_type(LIGHT_SLEEP_T);
+    wifi_fpm_open();
+    gpio_pin_wakeup_enable(GPIO_ID_PIN(LORA_DIO1), GPIO_PIN_INTR_HILEVEL);
+    wifi_fpm_set_wakeup_cb(lightSleepWakeup);
+    bool slept = wifi_fpm_do_sleep(timeoutMs * 1000) == 0;
+    if (slept)
+    {
+        // the chip goes to sleep as soon as we give up the CPU
+        esp_delay(timeoutMs + 1, []()
+                  { return !lightSleepWoke; });
+    }
+    gpio_pin_wakeup_disable();
+    wifi_fpm_close();
+    wifi_set_opmode_current(opmode);
+
+    // the wake up level interrupt replaced the DIO1 edge interrupt
+    lora.setDio1Action(setFlag);
+    if (digitalRead(LORA_DIO1) == HIGH)
+    {
+        receivedFlag = true;
+    }
+    if (!slept)
+    {
+        yield();
+        return;
+    }
+
+    // millis() stood still while the chip slept, catch up from the RTC
+    // clock with whatever part of the interval millis() didn't count
+    uint64_t sleptUs = ((uint64_t)(system_get_rtc_time() - rtcStart) * system_rtc_clock_cali_proc()) >> 12;
+    unsigned long counted = millis() - millisStart;
+    if (sleptUs / 1000 > counted)
+    {
+        lightSleptMs += sleptUs / 1000 - counted;
+    }
+}
+
+// Flash address the update image goes to, at the end of the space between
+// the running sketch and the file system like Updater does it. 0 if it doesn't fit.
+uint32_t updateStartAddress()
+{
+    uint32_t sketchEnd = (ESP.getSketchSize() + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    uint32_t size = (sensorData.update.info.size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+    uint32_t end = FS_start - 0x40200000;
+    return end > size && end - size >= sketchEnd ? end - size : 0;
+}
+
+// Ask the gateway for one block and wait for it. data points into a static buffer.
+bool updateExchange(uint16_t block, const uint8_t *&data, size_t &length)
+{
+    static uint8_t reply[FRAME_MAX_SIZE];
+    uint16_t address = ownAddress();
+    size_t len = encodeUpdateRequest(frameBuffer, address, sensorData.update.id, block);
+    // leave the budget for the readings
+    if (!airtimeAllowed(timeOnAirUs(radioParams, len) + timeOnAirUs(radioParams, FRAME_MAX_SIZE)) ||
+        lora.transmit(frameBuffer, len) != RADIOLIB_ERR_NONE)
+    {
+        return false;
+    }
+    chargeAirtime(timeOnAirUs(radioParams, len));
+
+    receivedFlag = false;
+    if (lora.startReceive() != RADIOLIB_ERR_NONE)
+    {
+        return false;
+    }
+    unsigned long start = uptimeMs();
+    unsigned long timeout = ACK_TURNAROUND_MS + (timeOnAirUs(radioParams, FRAME_MAX_SIZE) + 2 * symbolTimeUs(radioParams)) / 1000 + 1;
+    while (!receivedFlag && uptimeMs() - start <= timeout)
+    {
+#if LIGHT_SLEEP_WAITS
+        lightSleep(timeout - (uptimeMs() - start) + 1);
+#else
+        yield();
+#endif
+    }
+    rxTimeUs += (uptimeMs() - start) * 1000;
+    lora.standby();
+    if (!receivedFlag)
+    {
+        return false;
+    }
+    receivedFlag = false;
+    return lora.readData(reply, sizeof(reply)) == RADIOLIB_ERR_NONE &&
+           decodeUpdateBlock(reply, lora.getPacketLength(), address, sensorData.update.id, block, data, length);
+}
+
+// Blocks arrive in order, so every sector is erased when the first block reaching into it comes in
+bool updateWriteBlock(uint32_t start, uint16_t block, const uint8_t *data, size_t length)
+{
+    uint32_t offset = (uint32_t)block * sensorData.update.info.blockSize;
+    for (uint32_t sector = (offset + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE; sector * FLASH_SECTOR_SIZE < offset + length; sector++)
+    {
+        if (!ESP.flashEraseSector(start / FLASH_SECTOR_SIZE + sector))
+        {
+            return false;
+        }
+    }
+    // flash is written in whole words
+    uint32_t words[(FRAME_MAX_SIZE + 3) / 4];
+    memset(words, 0xff, sizeof(words));
+    memcpy(words, data, length);
+    return ESP.flashWrite(start + offset, words, (length + 3) & ~3);
+}
+
+// Check the whole image against its CRC and hand it to eboot, which copies it over the sketch on the next boot
+void updateInstall(uint32_t start)
+{
+    UpdateState &update = sensorData.update;
+    uint32_t crc = 0xffffffff;
+    uint32_t words[64];
+    uint8_t first = 0;
+    for (uint32_t offset = 0; offset < update.info.size; offset += sizeof(words))
+    {
+        size_t length = update.info.size - offset < sizeof(words) ? update.info.size - offset : sizeof(words);
+        if (!ESP.flashRead(start + offset, words, sizeof(words)))
+        {
+            break;
+        }
+        if (offset == 0)
+        {
+            first = ((uint8_t *)words)[0];
+        }
+        crc = updateCrc32(crc, (uint8_t *)words, length);
+    }
+    // a sketch image starts with 0xe9, a gzip compressed one with 0x1f
+    if (crc != update.info.crc || (first != 0xe9 && first != 0x1f))
+    {
+        Serial.println("Firmware update failed verification, starting over");
+        update.nextBlock = 0;
+        return;
+    }
+
+    Serial.println("Firmware update verified, restarting into it...");
+    eboot_command ebcmd;
+    ebcmd.action = ACTION_COPY_RAW;
+    ebcmd.args[0] = start;
+    ebcmd.args[1] = 0x00000;
+    ebcmd.args[2] = update.info.size;
+    // the command lives at the start of RTC user memory, so SensorData is
+    // gone afterwards, which the new firmware needs anyway if its layout changed
+    eboot_command_write(&ebcmd);
+    lora.sleep(false);
+    Serial.flush();
+    ESP.restart();
+}
+
+// Pull a few blocks of a pending firmware update while the radio is up anyway
+void updateFetch()
+{
+    UpdateState &update = sensorData.update;
+    const uint8_t *data;
+    size_t length;
+    for (int i = 0; i < UPDATE_BLOCKS_PER_WAKE; i++)
+    {
+        if (update.info.size == 0)
+        {
+            if (!updateExchange(UPDATE_INFO_BLOCK, data, length) || !decodeUpdateInfo(data, length, update.info) ||
+                UPDATE_BLOCK_HEADER_SIZE + update.info.blockSize > FRAME_MAX_SIZE || updateStartAddress() == 0)
+            {
+                update.info = {};
+                break;
             }
+            continue;
+        }
+
+        uint16_t blocks = (update.info.size + update.info.blockSize - 1) / update.info.blockSize;
+        if (update.nextBlock >= blocks)
+        {
+            break;
+        }
+        uint32_t offset = (uint32_t)update.nextBlock * update.info.blockSize;
+        size_t expected = update.info.size - offset < update.info.blockSize ? update.info.size - offset : update.info.blockSize;
+        if (!updateExchange(update.nextBlock, data, length) || length != expected ||
+            !updateWriteBlock(updateStartAddress(), update.nextBlock, data, length))
+        {
+            // try again on the next wake
+            break;
+        }
+        update.nextBlock++;
+    }
+
+    if (update.info.size != 0)
+    {
+        uint16_t blocks = (update.info.size + update.info.blockSize - 1) / update.info.blockSize;
+        Serial.print("Firmware update: block ");
+        Serial.print(update.nextBlock);
+        Serial.print(" of ");
+        Serial.println(blocks);
+        if (update.nextBlock >= blocks)
+        {
+            updateInstall(updateStartAddress());
+        }
+    }
+}
+
+// the DS18B20 converts in the background, see startConversion()
+bool conversionPending = false;
+unsigned long conversionStartMs = 0;
+// the reading was converted during deep sleep, see goToSleep()
+bool conversionInSleep = false;
+// node clock the last reading was taken at
+uint32_t readingClock = 0;
+
+// Kick off a temperature conversion without waiting for it, up to 750 ms at 12 bit
+void startConversion()
+{
+    sensors.requestTemperatures();
+    conversionStartMs = uptimeMs();
+    conversionPending = true;
+}
+
+float readTemperature()
+{
+    if (!conversionPending)
+    {
+        startConversion();
+    }
+    // wait for whatever is left of the conversion, light sleep needs the
+    // radio set up to keep DIO1 from waking us at random
+    unsigned long conversionMs = sensors.millisToWaitForConversion(sensors.getResolution());
+    unsigned long elapsed = uptimeMs() - conversionStartMs;
+    Serial.print("Waiting ");
+    Serial.print(elapsed < conversionMs ? conversionMs - elapsed : 0);
+    Serial.println(" ms for the temperature conversion");
+    while (uptimeMs() - conversionStartMs < conversionMs)
+    {
+#if LIGHT_SLEEP_WAITS
+        if (radioActive)
+        {
+            lightSleep(conversionMs - (uptimeMs() - conversionStartMs));
+            continue;
+        }
+#endif
+        delay(1);
+    }
+    conversionPending = false;
+    return sensors.getTempCByIndex(0);
+}
+
+float getTemperature()
+{
+    float tempC = DEVICE_DISCONNECTED_C;
+    if (conversionInSleep)
+    {
+        conversionInSleep = false;
+        tempC = sensors.getTempCByIndex(0);
+        // 85 is what the scratchpad holds after power-on, the sensor lost
+        // power or never got the command, convert again
+        if (tempC == 85.0)
+        {
+            tempC = DEVICE_DISCONNECTED_C;
+        }
+        Serial.println(tempC == DEVICE_DISCONNECTED_C ? "No reading from deep sleep, converting again" : "Reading converted during deep sleep");
+        readingClock = sensorData.conversionClock;
+    }
+    if (tempC == DEVICE_DISCONNECTED_C)
+    {
+        tempC = readTemperature();
+        readingClock = nodeClock();
+    }
+    // Get the temperature in Celsius
+    Serial.print("Temperature for the device 1 (index 0) is: ");
+    Serial.println(tempC);
+    return tempC;
+}
+
+// Relay role, see RELAY_ENABLED
+struct RelayEntry
+{
+    unsigned long received; // uptimeMs()
+    uint8_t length;
+    uint8_t frame[FRAME_MAX_SIZE];
+};
+
+struct RelaySeen
+{
+    uint16_t address;
+    uint16_t messageId;
+};
+
+RelayEntry relayQueue[RELAY_QUEUE_MAX];
+uint8_t relayCount = 0;
+// entries that went into the MSG_RELAY frame in flight
+uint8_t relayForwarded = 0;
+RelaySeen relaySeen[RELAY_DEDUP_SIZE];
+uint8_t relaySeenNext = 0;
+unsigned long relayReadingMs = 0;
+// uplink heard and not answered yet, we wait for the gateway's ACK window to
+// pass first, see relayReceive()
+bool relayAckPending = false;
+FrameHeader relayAckHeader;
+unsigned long relayAckHeardMs = 0;
+// forwards that failed in a row, and when the last one ended
+uint8_t relayFailures = 0;
+unsigned long relayFailedMs = 0;
+
+// Bytes the first count queued entries take in a MSG_RELAY frame
+size_t relayBytes(uint8_t count)
+{
+    size_t len = FRAME_HEADER_SIZE;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        len += 3 + relayQueue[i].length;
+    }
+    return len;
+}
+
+size_t encodeRelay(uint8_t *buf)
+{
+    FrameHeader header = {MSG_RELAY, ownAddress(), (uint16_t)messageId};
+    size_t len = encodeHeader(buf, header);
+    for (uint8_t i = 0; i < relayForwarded; i++)
+    {
+        unsigned long age = (uptimeMs() - relayQueue[i].received) / 1000;
+        len = appendRelayed(buf, len, age > 0xffff ? 0xffff : age, relayQueue[i].frame, relayQueue[i].length);
+    }
+    return len;
+}
+
+static_assert(TRANSFER_BUFFER_SIZE >= FRAME_MAX_SIZE, "a MSG_RELAY doesn't fit the transfer buffer");
+
+bool relayQueueFrame(const uint8_t *frame, size_t length)
+{
+    if (relayCount == RELAY_QUEUE_MAX || relayBytes(relayCount) + 3 + length > FRAME_MAX_SIZE)
+    {
+        return false;
+    }
+    RelayEntry &entry = relayQueue[relayCount++];
+    entry.received = uptimeMs();
+    entry.length = length;
+    memcpy(entry.frame, frame, length);
+    return true;
+}
+
+// Returns true if the message was heard before, otherwise remembers it
+bool relayDuplicate(uint16_t address, uint16_t messageId)
+{
+    for (uint8_t i = 0; i < RELAY_DEDUP_SIZE; i++)
+    {
+        if (relaySeen[i].address == address && relaySeen[i].messageId == messageId)
+        {
+            return true;
+        }
+    }
+    relaySeen[relaySeenNext] = {address, messageId};
+    relaySeenNext = (relaySeenNext + 1) % RELAY_DEDUP_SIZE;
+    return false;
+}
+
+// Take a frame the gateway heard itself out of the queue
+void relayUnqueue(const FrameHeader &header)
+{
+    for (uint8_t i = 0; i < relayCount; i++)
+    {
+        FrameHeader queued;
+        if (decodeHeader(relayQueue[i].frame, relayQueue[i].length, queued) && queued.address == header.address &&
+            queued.messageId == header.messageId)
+        {
+            relayCount--;
+            memmove(relayQueue + i, relayQueue + i + 1, (relayCount - i) * sizeof(RelayEntry));
+            return;
+        }
+    }
+}
+
+// Uplinks worth forwarding, a link quality report (stats.h) only around one of them
+bool relayable(const uint8_t *frame, size_t length, const FrameHeader &header)
+{
+    uint8_t type = header.type;
+    if (type == MSG_STATS)
+    {
+        FrameHeader wrapped;
+        if (length < STATS_FRAME_OVERHEAD || !decodeHeader(frame + STATS_FRAME_OVERHEAD, length - STATS_FRAME_OVERHEAD, wrapped))
+        {
+            return false;
+        }
+        type = wrapped.type;
+    }
+    return type == MSG_DATA || type == MSG_BATCH || type == MSG_SERIES;
+}
+
+// Handle a packet heard while idle. Uplinks of other nodes are queued, and
+// answered once the gateway's ACK window is over, unless the gateway's ACK
+// comes in meanwhile. Answering right away would collide with that ACK.
+void relayReceive()
+{
+    uint8_t buf[FRAME_MAX_SIZE];
+    int16_t state = lora.readData(buf, sizeof(buf));
+    size_t length = lora.getPacketLength();
+    if (state == RADIOLIB_ERR_NONE && relayAckPending && ackValid(buf, length) &&
+        ackMatches(buf, relayAckHeader.address, relayAckHeader.messageId))
+    {
+        // the gateway has it, nothing left to do for us
+        relayAckPending = false;
+        relayUnqueue(relayAckHeader);
+        Serial.print("Gateway answered node ");
+        Serial.print(relayAckHeader.address, HEX);
+        Serial.println(" itself");
+        return;
+    }
+
+    FrameHeader header;
+    // without the time the relay can't hand out a usable epoch, and a
+    // frame that doesn't fit a MSG_RELAY has to go to the gateway directly.
+    // An uplink heard while another one waits for its answer gets it on its retry.
+    if (state != RADIOLIB_ERR_NONE || relayAckPending || sensorData.epochTime == 0 || length > FRAME_MAX_SIZE - FRAME_HEADER_SIZE - 3 ||
+        !decodeHeader(buf, length, header) || !relayable(buf, length, header) || header.address == ownAddress())
+    {
+        return;
+    }
+
+    // a retry of something already queued only needs the ACK again
+    bool duplicate = relayDuplicate(header.address, header.messageId);
+    if (!duplicate && !relayQueueFrame(buf, length))
+    {
+        Serial.println("Relay queue full, not answering");
+        relaySeenNext = (relaySeenNext + RELAY_DEDUP_SIZE - 1) % RELAY_DEDUP_SIZE;
+        relaySeen[relaySeenNext] = {};
+        return;
+    }
+    relayAckPending = true;
+    relayAckHeader = header;
+    relayAckHeardMs = uptimeMs();
+    Serial.print("Heard message ");
+    Serial.print(header.messageId);
+    Serial.print(" from node ");
+    Serial.print(header.address, HEX);
+    Serial.println(duplicate ? ", repeat" : "");
+}
+
+// The gateway's ACK window passed without its ACK, answer in its place.
+// The node listens for a second window on our data rate, see ackTimeoutMs().
+void relayAnswer()
+{
+    relayAckPending = false;
+    uint8_t ack[FRAME_ACK_MAX_SIZE];
+    AckFields fields;
+    fields.fullEpoch = true;
+    fields.viaRelay = true;
+    // pass on our own idea of the time, as exact as the gateway gave it to us
+    uint64_t nowMs = epochMs();
+    uint32_t epoch = nowMs / 1000;
+    fields.phase = nowMs % 1000;
+    size_t ackLength = encodeAck(ack, relayAckHeader.address, relayAckHeader.messageId, epoch, fields);
+    if (!airtimeAllowed(timeOnAirUs(radioParams, ackLength)))
+    {
+        Serial.println("Duty cycle budget used up, not answering");
+        return;
+    }
+    lora.transmit(ack, ackLength);
+    chargeAirtime(timeOnAirUs(radioParams, ackLength));
+    Serial.print("Relayed message ");
+    Serial.print(relayAckHeader.messageId);
+    Serial.print(" from node ");
+    Serial.println(relayAckHeader.address, HEX);
+}
+
+void relaySetup()
+{
+    // everything on the most robust data rate, the one nodes fall back to
+    sensorData.settings.dataRate = 0;
+    sensorData.settings.power = TPC_MAX_POWER;
+    applyFixedLink();
+    initRF();
+    // setup() already started the first conversion
+    relayReadingMs = conversionStartMs;
+    lora.startReceive();
+}
+
+// Carry the clock over a restart, like goToSleep() does over deep sleep
+void relayRestart()
+{
+    uint32_t elapsed = sensorData.clockFraction + uptimeMs();
+    sensorData.clock += elapsed / 1000;
+    sensorData.clockFraction = elapsed % 1000;
+    writeMemory();
+    Serial.println("Relay restarting...");
+    Serial.flush();
+    ESP.restart();
+}
+
+// Hold-off after relayFailures failed forwards in a row
+unsigned long relayRetryMs()
+{
+    uint8_t exponent = relayFailures > 0 ? relayFailures - 1 : 0;
+    unsigned long seconds = exponent < 8 ? (unsigned long)RELAY_RETRY_SECONDS << exponent : RELAY_RETRY_MAX_SECONDS;
+    return (seconds < RELAY_RETRY_MAX_SECONDS ? seconds : RELAY_RETRY_MAX_SECONDS) * 1000UL;
+}
+
+void relayLoop()
+{
+    if (radioState != RADIO_IDLE)
+    {
+        radioPoll();
+        if (radioState != RADIO_DONE)
+        {
+            return;
+        }
+        if (ackReceived)
+        {
+            relayCount -= relayForwarded;
+            memmove(relayQueue, relayQueue + relayForwarded, relayCount * sizeof(RelayEntry));
+            relayFailures = 0;
         }
         else
         {
-            Serial.print("Error transmitting message, code: ");
-            Serial.println(state);
+            // the queue is still due, so hold off or we'd be back on air right away
+            if (relayFailures < 255)
+            {
+                relayFailures++;
+            }
+            relayFailedMs = uptimeMs();
+            Serial.print("Forward failed, holding off for ");
+            Serial.print(relayRetryMs() / 1000);
+            Serial.println(" s");
         }
+        relayForwarded = 0;
+        radioState = RADIO_IDLE;
+        lora.startReceive();
+    }
 
-        // If ACK not received, wait for a random delay before retrying
-        if (!ackReceived)
+    if (receivedFlag)
+    {
+        receivedFlag = false;
+        relayReceive();
+        lora.startReceive();
+    }
+
+    if (relayAckPending && uptimeMs() - relayAckHeardMs >= ackWindowMs())
+    {
+        relayAnswer();
+        // the ACK transmission fired DIO1 as well
+        receivedFlag = false;
+        lora.startReceive();
+    }
+
+    // own reading, queued like the ones heard from other nodes. The sensor
+    // converts in the background and is read on a later pass once done, so
+    // the radio keeps listening and answering meanwhile
+    if (!conversionPending && uptimeMs() - relayReadingMs >= sensorData.settings.sleepSeconds * 1000UL)
+    {
+        relayReadingMs = uptimeMs();
+        startConversion();
+    }
+    if (conversionPending && uptimeMs() - conversionStartMs >= sensors.millisToWaitForConversion(sensors.getResolution()))
+    {
+        temperature = getTemperature();
+        uint8_t frame[FRAME_DATA_SIZE];
+        sensorData.messageId++;
+        encodeData(frame, ownAddress(), (uint16_t)sensorData.messageId, epochDelta(nodeClock()), toCentiDegrees(temperature));
+        relayQueueFrame(frame, sizeof(frame));
+#if DISPLAY_ENABLED
+        if (displayDue(true))
         {
-            Serial.print("No ACK received, retrying...");
-            delay(randomDelay);
+            // not while listening, like in loop()
+            lora.standby();
+            updateDisplay();
+            lora.startReceive();
         }
+#endif
     }
 
-    if (!ackReceived)
+    // not on air while an uplink waits for its answer
+    if (relayAckPending)
     {
-        Serial.println("Failed to receive correct ACK after maximum retries.");
+        return;
     }
-    else
+    if (relayCount > 0 && (relayFailures == 0 || uptimeMs() - relayFailedMs >= relayRetryMs()) &&
+        (uptimeMs() - relayQueue[0].received >= RELAY_HOLD_SECONDS * 1000UL || relayBytes(relayCount) >= RELAY_FORWARD_BYTES ||
+         relayCount == RELAY_QUEUE_MAX))
     {
-        Serial.print("Stored datetime: ");
-        Serial.println(sensorData.epochTime);
-        Serial.print("Message ID: ");
-        Serial.println(sensorData.messageId);
-        // Write the updated sensor data to RTC memory
+        sensorData.messageId++;
+        messageId = sensorData.messageId;
+        relayForwarded = relayCount;
+        radioStart();
+    }
+    else if (uptimeMs() >= RELAY_RESTART_HOURS * 3600000UL && relayCount == 0)
+    {
+        relayRestart();
+    }
+}
+
+void setup()
+{
+    // initialize the serial port
+    Serial.begin(9600);
+    while (!Serial)
+        delay(10); // wait for Serial to be initialized
+
+    // Read struct from RTC memory
+    readMemory();
+
+    // start the temperature conversion first, the rest of the wake runs while
+    // the sensor converts. If it already ran during deep sleep the scratchpad
+    // just has to be read.
+    sensors.begin();
+    sensors.setWaitForConversion(false);
+    conversionInSleep = sensorData.conversionPending && ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+    sensorData.conversionPending = false;
+    if (!conversionInSleep)
+    {
+        startConversion();
+    }
+
+    pinMode(RX, OUTPUT);
+    digitalWrite(RX, HIGH);
+    // readSensorDataFromRtc(sensorData, sensorData);
+    Serial.println("Data stored in RTC memory: ");
+    Serial.print("Sensor ID: ");
+    Serial.println(sensorData.sensorId);
+    Serial.print("Message ID: ");
+    Serial.println(sensorData.messageId);
+    Serial.print("Datetime: ");
+    Serial.println(sensorData.epochTime);
+
+    // Initialize the sensor ID if it's not set
+    uint64_t chipId = getChipId();
+    if (sensorData.sensorId != chipId)
+    {
+        Serial.println("Sensor ID not set, initializing...");
+        Serial.print("Chip ID: ");
+        Serial.println(chipId);
+        Serial.print("Chip ID (HEX): ");
+        Serial.println(chipId, HEX);
+        sensorData.sensorId = chipId;
+        sensorData.messageId = 0;
+        sensorData.epochTime = 0;
+        sensorData.clock = 0;
+        sensorData.clockFraction = 0;
+        sensorData.ackClock = 0;
+        sensorData.ackClockFraction = 0;
+        sensorData.slot = SLOT_NONE;
+        sensorData.wakeLeadMs = 0;
+        sensorData.radioSignature = 0;
+        linkInit(sensorData.link);
+        sensorData.batch = {};
+        sensorData.backlogCount = 0;
+        sensorData.lastTemperature = TEMPERATURE_INVALID;
+        sensorData.quietCycles = 0;
+        sensorData.settings = {SLEEP_SECONDS, BATCH_SIZE, DISPLAY_POLICY, DATA_RATE_AUTO, POWER_AUTO};
+        sensorData.displayedTemperature = TEMPERATURE_INVALID;
+        sensorData.update = {};
+        sensorData.dutyCycle = {};
+        sensorData.stats = {};
+        sensorData.statsCycles = 0;
+        sensorData.conversionPending = false;
+        sensorData.conversionClock = 0;
         // writeSensorDataToRtc(sensorData, sensorData);
         writeMemory();
     }
 
-    // display.init(115200, true, 50, false);
-    // display_temp(sensorData.epochTime, loraMessage.temperature);
-    // display.hibernate();
+    EEPROM.begin(BACKLOG_EEPROM_OFFSET + BACKLOG_MAX * sizeof(BacklogEntry));
+
+#if RELAY_ENABLED
+    relaySetup();
+#endif
+}
+
+int count = 0;
+
+// Without a slot we just sleep for the period. With one, sleep until the
+// node has to be awake to transmit at the start of its slot in the next period.
+uint32_t sleepDurationMs()
+{
+    uint32_t periodMs = sensorData.settings.sleepSeconds * 1000UL;
+    if (sensorData.slot == SLOT_NONE || sensorData.epochTime == 0)
+    {
+        return periodMs;
+    }
+
+    // the epoch right now, to the millisecond if the gateway sent the ACK phase
+    uint64_t nowMs = epochMs();
+
+    uint32_t slotMs = (uint32_t)sensorData.slot * 1000 % periodMs;
+    uint32_t sinceSlot = (nowMs + periodMs - slotMs) % periodMs;
+    int32_t sleepMs = (int32_t)(periodMs - sinceSlot) - sensorData.wakeLeadMs - WAKE_OVERHEAD_MS;
+    // too close, aim for the slot after
+    if (sleepMs < (int32_t)periodMs / 2)
+    {
+        sleepMs += periodMs;
+    }
+    return sleepMs;
+}
+
+void goToSleep()
+{
+    if (radioActive && lora.sleep(true) == RADIOLIB_ERR_NONE)
+    {
+        // keep the configuration, the next radio wake can skip lora.begin()
+        sensorData.radioSignature = radioSignature();
+    }
+
+    uint32_t sleepMs = sleepDurationMs();
+    if (sleepMs * 1000ULL > ESP.deepSleepMax())
+    {
+        sleepMs = ESP.deepSleepMax() / 1000;
+    }
+
+#if CONVERT_IN_SLEEP
+    // a parasite powered sensor needs the strong pull-up of the bus through
+    // the conversion, only an externally powered one converts on its own
+    if (!sensors.isParasitePowerMode() && sleepMs >= sensors.millisToWaitForConversion(sensors.getResolution()))
+    {
+        sensors.requestTemperatures();
+        sensorData.conversionPending = true;
+        sensorData.conversionClock = nodeClock();
+    }
+#endif
+
+    // Write the updated sensor data to RTC memory, the clock has to be
+    // carried over even when the message was not acknowledged
+    uint32_t elapsed = sensorData.clockFraction + uptimeMs() + sleepMs + WAKE_OVERHEAD_MS;
+    sensorData.clock += elapsed / 1000;
+    sensorData.clockFraction = elapsed % 1000;
+
+    // writeSensorDataToRtc(sensorData, sensorData);
+    writeMemory();
 
     Serial.println("Going to sleep for 1 hour...");
     Serial.flush();
@@ -525,5 +2204,165 @@ void loop()
 
     // Enter deep sleep for one hour
     // ESP.deepSleep(3600e6, RF_DISABLED); // Sleep for 1 hour
-    ESP.deepSleep(60e6, RF_DISABLED); // Sleep for 1 minute
+    ESP.deepSleep(sleepMs * 1000ULL, RF_DISABLED); // Sleep for about 1 minute
+}
+
+void loop()
+{
+#if RELAY_ENABLED
+    relayLoop();
+    return;
+#endif
+    // When the radio is going to be used whatever the reading, bring it up
+    // while the sensor is still converting: the heartbeat is due, the batch
+    // is due already, or the new reading is sure to be queued and fills it
+    bool sampleCertain = DEADBAND == 0 || sensorData.lastTemperature == TEMPERATURE_INVALID;
+    if (sensorData.quietCycles + 1 >= HEARTBEAT_CYCLES || (sensorData.batch.count > 0 && batchDue()) ||
+        (sampleCertain && sensorData.batch.count + 1 >= sensorData.settings.batchSize))
+    {
+        initRF();
+        radioActive = true;
+    }
+
+    temperature = getTemperature(); //(float)random(0, 2500) / 100;
+    int16_t centi = toCentiDegrees(temperature);
+
+    // Only queue readings that moved past the deadband, unless the heartbeat is due
+    bool heartbeat = sensorData.quietCycles + 1 >= HEARTBEAT_CYCLES;
+    if (heartbeat || abs((int32_t)centi - sensorData.lastTemperature) >= DEADBAND)
+    {
+        addSample(centi, readingClock);
+        sensorData.lastTemperature = centi;
+    }
+
+    if (sensorData.batch.count == 0 || (!heartbeat && !batchDue()))
+    {
+        Serial.print("Readings pending: ");
+        Serial.print(sensorData.batch.count);
+        Serial.println(", radio stays off");
+        sensorData.quietCycles++;
+#if DISPLAY_ENABLED
+        if (displayDue(false))
+        {
+            updateDisplay();
+        }
+#endif
+        goToSleep();
+        return;
+    }
+
+    // keep collecting readings until the budget allows an uplink again
+    applyLinkParams();
+    if (!airtimeAllowed(timeOnAirUs(radioParams, encodeFrame())))
+    {
+        Serial.print("Duty cycle budget used up, ");
+        Serial.print(sensorData.batch.count);
+        Serial.println(" readings wait for the next wake");
+        sensorData.quietCycles++;
+        goToSleep();
+        return;
+    }
+
+    sensorData.quietCycles = 0;
+    if (!radioActive)
+    {
+        initRF();
+        radioActive = true;
+    }
+
+    sensorData.messageId++;
+    messageId = sensorData.messageId;
+
+    radioStart();
+    while (radioState != RADIO_DONE)
+    {
+        radioPoll();
+#if LIGHT_SLEEP_WAITS
+        lightSleep(radioIdleMs());
+#else
+        yield();
+#endif
+    }
+#if DISPLAY_ENABLED
+    // only now, display SPI traffic must not get in the way of the radio
+    if (displayDue(true))
+    {
+        updateDisplay();
+    }
+#endif
+
+    if (sensorData.statsCycles < 0xffff)
+    {
+        sensorData.statsCycles++;
+    }
+    if (!ackReceived)
+    {
+        Serial.println("Failed to receive correct ACK after maximum retries.");
+        if (statsSent)
+        {
+            // try the report again after another STATS_INTERVAL uplinks, not
+            // on every one, the failure counts into it meanwhile
+            sensorData.statsCycles = 0;
+        }
+        statsRecordFailure(sensorData.stats);
+        bool changed = linkAckMissed(sensorData.link);
+        if (sensorData.link.missed >= ADR_FALLBACK_CYCLES)
+        {
+            // a data rate or power the gateway fixed may be what keeps its
+            // ACKs from getting through, and only an ACK could undo it
+            sensorData.settings.dataRate = DATA_RATE_AUTO;
+            sensorData.settings.power = POWER_AUTO;
+        }
+        applyFixedLink();
+        if (changed)
+        {
+            printLink();
+        }
+    }
+    else
+    {
+        Serial.print("Stored datetime: ");
+        Serial.println(sensorData.epochTime);
+        Serial.print("Message ID: ");
+        Serial.println(sensorData.messageId);
+        sensorData.batch.count = 0;
+        sensorData.backlogCount = 0;
+        if (statsSent)
+        {
+            // the report got through, start the next one
+            sensorData.stats = {};
+            sensorData.statsCycles = 0;
+        }
+        statsRecordAck(sensorData.stats, ackRssi, ackSnr, radioAttempt + 1, ackLatencyMs);
+#if !FAST_RADIO_PROFILE
+        if (sensorData.update.id != 0)
+        {
+            updateFetch();
+        }
+#endif
+    }
+
+    Serial.print("Airtime: ");
+    Serial.print(txAirtimeUs / 1000);
+    Serial.print(" ms TX, ");
+    Serial.print(rxTimeUs / 1000);
+    Serial.print(" ms RX, ");
+    Serial.print(energyMj(txAirtimeUs, txCurrentMa(radioParams.power)) + energyMj(rxTimeUs, SX126X_RX_CURRENT_MA));
+    Serial.println(" mJ");
+    int band = subBandIndex(radioParams.freq);
+    Serial.print("Duty cycle: ");
+    Serial.print(dutyCycleUsedMs(sensorData.dutyCycle, band));
+    Serial.print(" of ");
+    Serial.print(dutyCycleBudgetMs(band));
+    Serial.println(" ms used in the last hour");
+    if (rxSavedUs > 0)
+    {
+        Serial.print("RX duty cycle slept ");
+        Serial.print(rxSavedUs / 1000);
+        Serial.print(" ms, saving about ");
+        Serial.print(energyMj(rxSavedUs, SX126X_RX_CURRENT_MA));
+        Serial.println(" mJ");
+    }
+
+    goToSleep();
 }
@@ -0,0 +1,167 @@
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+
+#include "airtime.h"
+#include "link.h"
+
+// Every combination we might deploy: the data rates in link.h and their
+// neighbours, at the node's 20 symbol preamble, explicit header and CRC
+const uint8_t spreadingFactors[] = {7, 8, 9, 10, 11, 12};
+const float bandwidths[] = {62.5f, 125.0f, 250.0f};
+
+LoRaParams params(uint8_t sf, float bw)
+{
+    return LoRaParams{868.0f, bw, sf, 5, 0x24, 22, 20, false, true};
+}
+
+// The formula of Semtech AN1200.13 in floating point, as an independent check
+double referenceMs(const LoRaParams &p, uint8_t len)
+{
+    double symbolMs = pow(2, p.sf) / p.bw;
+    int de = symbolMs >= 16.0 ? 1 : 0;
+    double numerator = 8.0 * len - 4.0 * p.sf + 28 + (p.crc ? 16 : 0) - (p.implicitHeader ? 20 : 0);
+    double payloadSymbols = 8 + fmax(ceil(numerator / (4.0 * (p.sf - 2 * de))) * p.cr, 0);
+    return (p.preambleLength + 4.25 + payloadSymbols) * symbolMs;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_known_values(void)
+{
+    // Semtech LoRa calculator, 8 symbol preamble, CR 4/5, CRC on, explicit header
+    TEST_ASSERT_EQUAL(41216, timeOnAirUs(LoRaParams{868.0f, 125.0f, 7, 5, 0x24, 14, 8, false, true}, 10));
+    TEST_ASSERT_EQUAL(2465792, timeOnAirUs(LoRaParams{868.0f, 125.0f, 12, 5, 0x24, 14, 8, false, true}, 51));
+}
+
+void test_low_data_rate_optimize(void)
+{
+    // on from 16 ms symbols, like RadioLib
+    TEST_ASSERT_FALSE(lowDataRateOptimize(params(10, 125.0f)));
+    TEST_ASSERT_TRUE(lowDataRateOptimize(params(10, 62.5f)));
+    TEST_ASSERT_TRUE(lowDataRateOptimize(params(11, 125.0f)));
+    TEST_ASSERT_FALSE(lowDataRateOptimize(params(11, 250.0f)));
+}
+
+// Tabulates the airtime of every payload size on every combination and
+// checks each entry against the reference formula
+void test_table_against_reference(void)
+{
+    printf("time on air in ms, 20 symbol preamble, CR 4/5, CRC, explicit header\n");
+    printf("len");
+    for (uint8_t sf : spreadingFactors)
+    {
+        for (float bw : bandwidths)
+        {
+            char label[24];
+            snprintf(label, sizeof(label), "SF%u/%g", sf, bw);
+            printf(" %10s", label);
+        }
+    }
+    printf("\n");
+
+    for (unsigned len = 1; len <= 255; len++)
+    {
+        printf("%3u", len);
+        for (uint8_t sf : spreadingFactors)
+        {
+            for (float bw : bandwidths)
+            {
+                LoRaParams p = params(sf, bw);
+                uint32_t us = timeOnAirUs(p, len);
+                printf(" %10.2f", us / 1000.0);
+                // integer math truncates to the microsecond
+                TEST_ASSERT_LESS_OR_EQUAL(1.0, fabs(us / 1000.0 - referenceMs(p, len)) * 1000.0);
+                TEST_ASSERT_GREATER_OR_EQUAL(timeOnAirUs(p, len - 1), us);
+            }
+        }
+        printf("\n");
+    }
+}
+
+void test_fast_profile(void)
+{
+    for (uint8_t sf : spreadingFactors)
+    {
+        for (float bw : bandwidths)
+        {
+            LoRaParams p = params(sf, bw);
+            LoRaParams fast = fastProfile(p);
+            TEST_ASSERT_LESS_THAN(timeOnAirUs(p, 9), timeOnAirUs(fast, 9));
+            TEST_ASSERT_LESS_OR_EQUAL(1.0, fabs(timeOnAirUs(fast, 9) / 1000.0 - referenceMs(fast, 9)) * 1000.0);
+        }
+    }
+}
+
+// TCXO start up the node configures, see LORA_TCXO_DELAY_US in main.cpp
+#define TCXO_DELAY_US 5000
+
+void test_sniff_timing(void)
+{
+    LoRaParams p = params(10, 62.5f);
+    SniffTiming sniff = sniffTiming(p, 8, TCXO_DELAY_US);
+    // every preamble overlaps at least 8 symbols of listening
+    TEST_ASSERT_GREATER_THAN(0, sniff.sleepUs);
+    TEST_ASSERT_GREATER_OR_EQUAL(9 * symbolTimeUs(p), sniff.rxUs);
+    TEST_ASSERT_LESS_OR_EQUAL(p.preambleLength * symbolTimeUs(p), sniff.rxUs + sniff.sleepUs);
+    // too short to sleep at all
+    p.preambleLength = 16;
+    TEST_ASSERT_EQUAL(0, sniffTiming(p, 8, TCXO_DELAY_US).sleepUs);
+    // 4 symbols of SF7/125 are 4096 us, less than the TCXO delay and the transition
+    p = params(7, 125.0f);
+    TEST_ASSERT_EQUAL(0, sniffTiming(p, 8, TCXO_DELAY_US).sleepUs);
+    TEST_ASSERT_GREATER_THAN(0, sniffTiming(p, 8, 0).sleepUs);
+}
+
+// Every data rate the node can end up on, with and without the fast profile,
+// must either listen continuously or pass the checks of RadioLib's
+// startReceiveDutyCycle(): the sleep left after the transition time and
+// both periods in 15.625 us steps have to fit 24 bits and not be 0
+void test_sniff_timing_data_rates(void)
+{
+    for (const DataRate &dr : dataRates)
+    {
+        for (int fast = 0; fast < 2; fast++)
+        {
+            LoRaParams p = params(dr.sf, dr.bw);
+            if (fast)
+            {
+                p = fastProfile(p);
+            }
+            SniffTiming sniff = sniffTiming(p, 8, TCXO_DELAY_US);
+            printf("SF%u/%g%s: rx %u us, sleep %u us\n", dr.sf, dr.bw, fast ? " fast" : "", (unsigned)sniff.rxUs, (unsigned)sniff.sleepUs);
+            if (sniff.sleepUs == 0)
+            {
+                TEST_ASSERT_EQUAL(0, sniff.rxUs);
+                continue;
+            }
+            uint32_t transitionUs = TCXO_DELAY_US + 1000;
+            TEST_ASSERT_GREATER_THAN(transitionUs, sniff.sleepUs);
+            uint32_t sleepRaw = (sniff.sleepUs - transitionUs) * 8 / 125;
+            uint32_t rxRaw = sniff.rxUs * 8 / 125;
+            TEST_ASSERT_GREATER_THAN(0, sleepRaw);
+            TEST_ASSERT_GREATER_THAN(0, rxRaw);
+            TEST_ASSERT_EQUAL(0, sleepRaw & 0xff000000);
+            TEST_ASSERT_EQUAL(0, rxRaw & 0xff000000);
+            TEST_ASSERT_GREATER_OR_EQUAL(9 * symbolTimeUs(p), sniff.rxUs);
+        }
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_known_values);
+    RUN_TEST(test_low_data_rate_optimize);
+    RUN_TEST(test_table_against_reference);
+    RUN_TEST(test_fast_profile);
+    RUN_TEST(test_sniff_timing);
+    RUN_TEST(test_sniff_timing_data_rates);
+    return UNITY_END();
+}
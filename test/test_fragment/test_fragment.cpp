@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "fragment.h"
+#include "link.h"
+
+// Loss simulation of fragmented transfers, following the node's rounds in
+// main.cpp: every fragment the gateway hasn't confirmed goes out back to
+// back, parity too as long as nothing is confirmed yet, and the last frame
+// asks for the ACK. A lost ACK, or a lost last frame, costs a timeout and
+// the round is repeated, up to MAX_ATTEMPTS rounds.
+#define MAX_ATTEMPTS 5
+#define TRANSFERS 20000
+#define PAYLOAD_SIZE 600
+
+uint32_t seed = 1;
+
+// uniform in [0, 1)
+double randomUnit()
+{
+    seed = seed * 1664525 + 1013904223;
+    return (seed >> 8) / 16777216.0;
+}
+
+uint8_t payload[PAYLOAD_SIZE];
+uint8_t frame[FRAME_MAX_SIZE];
+Reassembly gateway;
+
+struct SimResult
+{
+    double frames;
+    double rounds;
+    unsigned failed;
+};
+
+SimResult simulate(double loss, uint8_t group)
+{
+    uint8_t chunk = dataRates[0].maxPayload - FRAGMENT_HEADER_SIZE - 2;
+    uint8_t count = fragmentCount(PAYLOAD_SIZE, chunk);
+    uint8_t parity = parityCount(count, group);
+    unsigned long frames = 0, rounds = 0;
+    unsigned failed = 0;
+    for (uint16_t transfer = 0; transfer < TRANSFERS; transfer++)
+    {
+        for (size_t i = 0; i < sizeof(payload); i++)
+        {
+            payload[i] = randomUnit() * 256;
+        }
+        gateway.count = 0;
+        uint32_t missing = fragmentMask(count);
+        int attempt = 0;
+        for (; attempt < MAX_ATTEMPTS && missing != 0; attempt++)
+        {
+            uint32_t data = missing;
+            uint32_t parityToSend = missing == fragmentMask(count) ? fragmentMask(parity) : 0;
+            bool ackRequested = false;
+            while (data != 0 || parityToSend != 0)
+            {
+                uint32_t &pending = data != 0 ? data : parityToSend;
+                uint8_t index = 0;
+                while (!(pending & (1UL << index)))
+                {
+                    index++;
+                }
+                pending &= ~(1UL << index);
+                bool last = data == 0 && parityToSend == 0;
+                size_t len = &pending == &parityToSend ? encodeParity(frame, 0x1234, transfer, payload, PAYLOAD_SIZE, chunk, group, index, last)
+                                                       : encodeFragment(frame, 0x1234, transfer, payload, PAYLOAD_SIZE, chunk, group, index, last);
+                frames++;
+                if (randomUnit() >= loss)
+                {
+                    TEST_ASSERT_TRUE(reassemblyAdd(gateway, frame, len));
+                    ackRequested = fragmentAckRequested(frame);
+                }
+            }
+            if (ackRequested && randomUnit() >= loss)
+            {
+                missing &= ~gateway.received;
+            }
+        }
+        rounds += attempt;
+        if (missing != 0)
+        {
+            failed++;
+            continue;
+        }
+        TEST_ASSERT_TRUE(reassemblyComplete(gateway));
+        TEST_ASSERT_EQUAL(PAYLOAD_SIZE, gateway.length);
+        TEST_ASSERT_EQUAL_MEMORY(payload, gateway.data, PAYLOAD_SIZE);
+    }
+    return {(double)frames / TRANSFERS, (double)rounds / TRANSFERS, failed};
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_round_trip(void)
+{
+    for (size_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i;
+    }
+    uint8_t chunk = 40;
+    uint8_t count = fragmentCount(PAYLOAD_SIZE, chunk);
+    gateway.count = 0;
+    // out of order, the short last fragment first
+    for (int index = count - 1; index >= 0; index--)
+    {
+        size_t len = encodeFragment(frame, 0x1234, 9, payload, PAYLOAD_SIZE, chunk, 0, index, index == 0);
+        TEST_ASSERT_TRUE(reassemblyAdd(gateway, frame, len));
+    }
+    TEST_ASSERT_TRUE(reassemblyComplete(gateway));
+    TEST_ASSERT_TRUE(fragmentAckRequested(frame));
+    TEST_ASSERT_EQUAL_MEMORY(payload, gateway.data, PAYLOAD_SIZE);
+}
+
+// One lost fragment per group comes back from parity, the short last one included
+void test_parity_recovers(void)
+{
+    for (size_t i = 0; i < sizeof(payload); i++)
+    {
+        payload[i] = i * 7;
+    }
+    uint8_t chunk = 40, group = 4;
+    uint8_t count = fragmentCount(PAYLOAD_SIZE, chunk);
+    gateway.count = 0;
+    for (uint8_t index = 0; index < count; index++)
+    {
+        if (index % group == group - 1 || index == count - 1)
+        {
+            continue;
+        }
+        reassemblyAdd(gateway, frame, encodeFragment(frame, 0x1234, 9, payload, PAYLOAD_SIZE, chunk, group, index, false));
+    }
+    TEST_ASSERT_FALSE(reassemblyComplete(gateway));
+    for (uint8_t index = 0; index < parityCount(count, group); index++)
+    {
+        reassemblyAdd(gateway, frame, encodeParity(frame, 0x1234, 9, payload, PAYLOAD_SIZE, chunk, group, index, false));
+    }
+    TEST_ASSERT_TRUE(reassemblyComplete(gateway));
+    TEST_ASSERT_EQUAL_MEMORY(payload, gateway.data, PAYLOAD_SIZE);
+}
+
+// Frames and rounds per transfer at each loss rate, with and without parity
+void test_loss_simulation(void)
+{
+    const double losses[] = {0.05, 0.10, 0.20, 0.30};
+    const uint8_t groups[] = {0, 8, 4, 2};
+    printf("%u byte payload on SF%u/%g, %u transfers per cell, ACKs lost at the same rate\n", PAYLOAD_SIZE, dataRates[0].sf, dataRates[0].bw,
+           TRANSFERS);
+    printf("loss  group  frames  rounds  failed\n");
+    for (double loss : losses)
+    {
+        SimResult plain = {};
+        for (uint8_t group : groups)
+        {
+            SimResult r = simulate(loss, group);
+            printf("%3.0f%%  %5u  %6.1f  %6.2f  %6u\n", loss * 100, group, r.frames, r.rounds, r.failed);
+            if (group == 0)
+            {
+                plain = r;
+            }
+            else if (loss >= 0.10)
+            {
+                // parity has to save rounds on a lossy link
+                TEST_ASSERT_LESS_THAN(plain.rounds, r.rounds);
+            }
+        }
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_parity_recovers);
+    RUN_TEST(test_loss_simulation);
+    return UNITY_END();
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <unity.h>
+
+#include "frame.h"
+#include "link.h"
+
+// What loop() used to send: the LoRaMessage struct straight from memory,
+// laid out as on the ESP8266 (time_t is 64 bit on core 3). The old ACK
+// echoed the same struct.
+struct OldLoRaMessage
+{
+    uint64_t sensorId;
+    uint32_t messageId;
+    int64_t epochTime;
+    uint8_t cmd;
+    float temperature;
+};
+
+const LoRaParams baseParams = {868.0f, 62.5f, 10, 5, 0x24, 22, 20, false, true};
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_data_round_trip(void)
+{
+    uint8_t buf[FRAME_MAX_SIZE];
+    TEST_ASSERT_EQUAL(FRAME_DATA_SIZE, encodeData(buf, 0xbeef, 0x1234, 61, -1234));
+    // little endian regardless of the host
+    const uint8_t expected[] = {0x21, 0xef, 0xbe, 0x34, 0x12, 61, 0, 0x2e, 0xfb};
+    TEST_ASSERT_EQUAL_MEMORY(expected, buf, sizeof(expected));
+
+    FrameHeader header;
+    uint16_t epochDelta;
+    int16_t temperature;
+    TEST_ASSERT_TRUE(decodeData(buf, FRAME_DATA_SIZE, header, epochDelta, temperature));
+    TEST_ASSERT_EQUAL(MSG_DATA, header.type);
+    TEST_ASSERT_EQUAL(0xbeef, header.address);
+    TEST_ASSERT_EQUAL(0x1234, header.messageId);
+    TEST_ASSERT_EQUAL(61, epochDelta);
+    TEST_ASSERT_EQUAL(-1234, temperature);
+
+    TEST_ASSERT_FALSE(decodeData(buf, FRAME_DATA_SIZE - 1, header, epochDelta, temperature));
+    buf[0] = (1 << 4) | MSG_DATA;
+    TEST_ASSERT_FALSE(decodeData(buf, FRAME_DATA_SIZE, header, epochDelta, temperature));
+}
+
+void test_ack_round_trip(void)
+{
+    uint8_t buf[FRAME_ACK_MAX_SIZE];
+    TEST_ASSERT_EQUAL(FRAME_ACK_SIZE, encodeAck(buf, 0xbeef, 0x1234, 1700000000));
+    TEST_ASSERT_TRUE(ackValid(buf, FRAME_ACK_SIZE));
+    TEST_ASSERT_TRUE(ackMatches(buf, 0xbeef, 0x1234));
+    TEST_ASSERT_FALSE(ackMatches(buf, 0xbeef, 0x1235));
+    // the node corrects an estimate that is a few seconds off
+    TEST_ASSERT_EQUAL(1700000000, ackEpoch(buf, 1700000000 - 7));
+    TEST_ASSERT_EQUAL(1700000000, ackEpoch(buf, 1700000000 + 9));
+    TEST_ASSERT_EQUAL(0, ackEpoch(buf, 0));
+    TEST_ASSERT_EQUAL(SLOT_NONE, ackSlot(buf));
+    TEST_ASSERT_EQUAL(CMD_NONE, ackCommand(buf));
+    TEST_ASSERT_EQUAL(ACK_PHASE_NONE, ackPhase(buf));
+
+    AckFields fields;
+    fields.fullEpoch = true;
+    fields.slot = 42;
+    fields.hasFragments = true;
+    fields.fragments = 0x00ff00ff;
+    fields.phase = 999;
+    fields.cmd = CMD_SLEEP_INTERVAL;
+    fields.cmdValue = 300;
+    size_t len = encodeAck(buf, 0xbeef, 0x1234, 1700000000, fields);
+    TEST_ASSERT_EQUAL(FRAME_ACK_MAX_SIZE, len);
+    TEST_ASSERT_TRUE(ackValid(buf, len));
+    TEST_ASSERT_FALSE(ackValid(buf, len - 1));
+    TEST_ASSERT_EQUAL(1700000000, ackEpoch(buf, 0));
+    TEST_ASSERT_EQUAL(42, ackSlot(buf));
+    TEST_ASSERT_EQUAL_HEX32(0x00ff00ff, ackFragments(buf));
+    TEST_ASSERT_EQUAL(999, ackPhase(buf));
+    TEST_ASSERT_EQUAL(CMD_SLEEP_INTERVAL, ackCommand(buf));
+    TEST_ASSERT_EQUAL(300, ackCommandValue(buf));
+    TEST_ASSERT_FALSE(ackViaRelay(buf));
+
+    // the relay flag has no field, the others stay where they were
+    fields.viaRelay = true;
+    TEST_ASSERT_EQUAL(len, encodeAck(buf, 0xbeef, 0x1234, 1700000000, fields));
+    TEST_ASSERT_TRUE(ackViaRelay(buf));
+    TEST_ASSERT_EQUAL(42, ackSlot(buf));
+    TEST_ASSERT_EQUAL(999, ackPhase(buf));
+    TEST_ASSERT_EQUAL(300, ackCommandValue(buf));
+
+    TEST_ASSERT_EQUAL(FAST_ACK_SIZE, encodeAck(buf, 0xbeef, 0x1234, 1700000000, AckFields(), true));
+    TEST_ASSERT_EQUAL(ACK_PHASE_NONE, ackPhase(buf));
+    TEST_ASSERT_EQUAL(CMD_NONE, ackCommand(buf));
+}
+
+void test_centi_degrees(void)
+{
+    TEST_ASSERT_EQUAL(2106, toCentiDegrees(21.0625f));
+    TEST_ASSERT_EQUAL(-1006, toCentiDegrees(-10.0625f));
+    TEST_ASSERT_EQUAL(TEMPERATURE_INVALID, toCentiDegrees(1000.0f));
+}
+
+// Bytes and airtime of one reading and its ACK, old struct dump against v2,
+// on every data rate the node may pick
+void test_savings_against_struct_dump(void)
+{
+    TEST_ASSERT_EQUAL(32, sizeof(OldLoRaMessage));
+    const uint8_t oldSize = sizeof(OldLoRaMessage);
+
+    printf("uplink + ACK, bytes: old %u + %u, v2 %u + %u\n", oldSize, oldSize, FRAME_DATA_SIZE, FRAME_ACK_SIZE);
+    printf("SF  BW kHz   old ms    v2 ms   saved\n");
+    for (unsigned i = 0; i < DATA_RATE_COUNT; i++)
+    {
+        LoRaParams p = baseParams;
+        p.sf = dataRates[i].sf;
+        p.bw = dataRates[i].bw;
+        uint32_t oldUs = timeOnAirUs(p, oldSize) + timeOnAirUs(p, oldSize);
+        uint32_t newUs = timeOnAirUs(p, FRAME_DATA_SIZE) + timeOnAirUs(p, FRAME_ACK_SIZE);
+        printf("%2u  %6.1f  %7.1f  %7.1f  %5.1f%%\n", p.sf, p.bw, oldUs / 1000.0, newUs / 1000.0, 100.0 * (oldUs - newUs) / oldUs);
+        // at least a third less airtime, even where the preamble dominates
+        TEST_ASSERT_LESS_THAN(oldUs * 2 / 3, newUs);
+    }
+}
+
+void test_node_address_fold(void)
+{
+    // all 48 bits of the chip id count
+    TEST_ASSERT_EQUAL(0x0001, nodeAddress(0x000000000001ULL));
+    TEST_ASSERT_EQUAL(0x0001, nodeAddress(0x000000010000ULL));
+    TEST_ASSERT_EQUAL(0x0001, nodeAddress(0x000100000000ULL));
+    TEST_ASSERT_EQUAL(0x0000, nodeAddress(0x000100010000ULL));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_data_round_trip);
+    RUN_TEST(test_ack_round_trip);
+    RUN_TEST(test_centi_degrees);
+    RUN_TEST(test_savings_against_struct_dump);
+    RUN_TEST(test_node_address_fold);
+    return UNITY_END();
+}
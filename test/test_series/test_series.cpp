@@ -0,0 +1,202 @@
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unity.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "frame.h"
+#include "series.h"
+
+// Benchmark input. A recording can be passed in as a CSV file of
+// "seconds,celsius" lines, oldest first, with
+//   SERIES_TRACE=readings.csv pio test -e native -f test_series -v
+// Without one the trace below is generated: one reading a minute with a
+// second of jitter, a day/night swing and sensor noise, in the 1/16
+// degree steps of the DS18B20, and now and then a reading that was lost.
+#define TRACE_MAX 4096
+Sample trace[TRACE_MAX];
+unsigned traceLength = 0;
+
+const char *traceName = "generated";
+
+// ages count back from the newest reading, like collectSamples() does
+void setAges(const uint32_t *clocks)
+{
+    uint32_t newest = clocks[traceLength - 1];
+    for (unsigned i = 0; i < traceLength; i++)
+    {
+        uint32_t age = newest - clocks[i];
+        trace[i].age = age > 0xffff ? 0xffff : age;
+    }
+}
+
+void generateTrace()
+{
+    static uint32_t clocks[TRACE_MAX];
+    uint32_t seed = 12345;
+    uint32_t clock = 0;
+    while (traceLength < 24 * 60)
+    {
+        seed = seed * 1103515245 + 12345;
+        clock += 60 + (int)(seed >> 16) % 3 - 1;
+        if ((seed >> 8) % 50 == 0)
+        {
+            continue;
+        }
+        double celsius = 18.0 + 4.0 * sin(clock * 2 * M_PI / 86400) + ((seed >> 4) % 5 - 2) / 32.0;
+        clocks[traceLength] = clock;
+        trace[traceLength].temperature = fromSixteenths(lround(celsius * 16));
+        traceLength++;
+    }
+    setAges(clocks);
+}
+
+bool loadTrace(const char *path)
+{
+    static uint32_t clocks[TRACE_MAX];
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return false;
+    }
+    double seconds, celsius;
+    while (traceLength < TRACE_MAX && fscanf(f, "%lf,%lf", &seconds, &celsius) == 2)
+    {
+        clocks[traceLength] = (uint32_t)seconds;
+        trace[traceLength].temperature = toCentiDegrees(celsius);
+        traceLength++;
+    }
+    fclose(f);
+    if (traceLength < 2)
+    {
+        return false;
+    }
+    setAges(clocks);
+    traceName = path;
+    return true;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+uint8_t buf[SERIES_HEADER_SIZE + ((SERIES_MAX - 1) * SERIES_SAMPLE_MAX_BITS + 7) / 8];
+
+void checkRoundTrip(const Sample *samples, uint8_t count)
+{
+    uint8_t encoded = count;
+    size_t len = encodeSeries(buf, sizeof(buf), 0x1234, 7, 42, samples, encoded);
+    TEST_ASSERT_EQUAL(count, encoded);
+
+    static Sample decoded[SERIES_MAX];
+    FrameHeader header;
+    uint16_t epochDelta;
+    uint8_t decodedCount;
+    TEST_ASSERT_TRUE(decodeSeries(buf, len, header, epochDelta, decoded, decodedCount));
+    TEST_ASSERT_EQUAL(count, decodedCount);
+    TEST_ASSERT_EQUAL(42, epochDelta);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL(samples[i].age, decoded[i].age);
+        TEST_ASSERT_EQUAL(samples[i].temperature, decoded[i].temperature);
+    }
+}
+
+void test_round_trip_steady(void)
+{
+    Sample samples[16];
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        samples[i] = {(uint16_t)((16 - 1 - i) * 60), (int16_t)(2106 + (i % 3) * 6)};
+    }
+    checkRoundTrip(samples, 16);
+}
+
+// every code path: repeats, small and large steps, raw values and centi-degrees that don't fit sixteenths
+void test_round_trip_extremes(void)
+{
+    const Sample samples[] = {{0xffff, -5500}, {0xfff0, 12500}, {0x8000, 12501}, {0x7fff, 12501}, {100, 0}, {99, -1}, {98, -1}, {0, 2000}};
+    checkRoundTrip(samples, sizeof(samples) / sizeof(samples[0]));
+}
+
+void test_capacity(void)
+{
+    uint8_t count = 200;
+    size_t len = encodeSeries(buf, FRAME_MAX_SIZE, 0x1234, 7, 0, trace, count);
+    TEST_ASSERT_LESS_OR_EQUAL(FRAME_MAX_SIZE, len);
+    TEST_ASSERT_GREATER_THAN(0, count);
+}
+
+// Compression against MSG_BATCH and the old struct dump, and the time an encode takes
+void test_benchmark(void)
+{
+    const uint8_t counts[] = {16, 64, 128, 255};
+    printf("trace: %s, %u readings\n", traceName, traceLength);
+    printf("samples  series B  batch B  struct B  vs batch  vs struct  ns/encode  cycles/sample\n");
+    for (uint8_t wanted : counts)
+    {
+        // a short recording only makes one row
+        uint8_t count = wanted > traceLength ? traceLength : wanted;
+        // the newest readings, ages relative to the last one
+        const Sample *samples = trace + traceLength - count;
+        Sample window[SERIES_MAX];
+        for (uint8_t i = 0; i < count; i++)
+        {
+            window[i] = {(uint16_t)(samples[i].age - samples[count - 1].age), samples[i].temperature};
+        }
+        checkRoundTrip(window, count);
+
+        const int rounds = 2000;
+        size_t len = 0;
+        auto start = std::chrono::steady_clock::now();
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t cyclesStart = __rdtsc();
+#endif
+        for (int r = 0; r < rounds; r++)
+        {
+            uint8_t n = count;
+            len = encodeSeries(buf, sizeof(buf), 0x1234, r, 0, window, n);
+        }
+        double cycles = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        cycles = (double)(__rdtsc() - cyclesStart) / rounds / count;
+#endif
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+
+        size_t batch = FRAME_HEADER_SIZE + 3 + 4 * (size_t)count;
+        size_t dump = 32 * (size_t)count;
+        printf("%7u  %8zu  %7zu  %8zu  %7.1fx  %8.1fx  %9.0f  %13.1f\n", count, len, batch, dump, (double)batch / len, (double)dump / len, ns,
+               cycles);
+        // below a batch the header dominates
+        if (count >= 16)
+        {
+            TEST_ASSERT_LESS_THAN(batch * 6 / 10, len);
+        }
+        if (count < wanted)
+        {
+            break;
+        }
+    }
+}
+
+int main()
+{
+    const char *path = getenv("SERIES_TRACE");
+    if (path == NULL || !loadTrace(path))
+    {
+        generateTrace();
+    }
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip_steady);
+    RUN_TEST(test_round_trip_extremes);
+    RUN_TEST(test_capacity);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}